@@ -0,0 +1,42 @@
+#pragma once
+
+// Strict parsing of numeric command line arguments
+// The whole string must be a number. Unlike std::stoul, unsigned values take no sign (so "-1" does not wrap around
+// to a huge count) and trailing characters (as in "4abc") are rejected instead of ignored.
+
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+
+namespace jaffar
+{
+
+namespace argumentParser
+{
+
+inline bool parseUnsigned(const std::string &string, size_t &value)
+{
+  if (string.empty() == true || std::isdigit((unsigned char)string[0]) == 0) return false;
+  const auto end = string.data() + string.size();
+  size_t parsedValue = 0;
+  const auto [ptr, ec] = std::from_chars(string.data(), end, parsedValue);
+  if (ec != std::errc() || ptr != end) return false;
+  value = parsedValue;
+  return true;
+}
+
+inline bool parseDouble(const std::string &string, double &value)
+{
+  if (string.empty() == true || std::isspace((unsigned char)string[0]) != 0) return false;
+  char *end = nullptr;
+  const double parsedValue = std::strtod(string.c_str(), &end);
+  if (end != string.c_str() + string.size() || std::isfinite(parsedValue) == false) return false;
+  value = parsedValue;
+  return true;
+}
+
+} // namespace argumentParser
+
+} // namespace jaffar
@@ -0,0 +1,496 @@
+#include "argparse/argparse.hpp"
+#include <jaffarCommon/exceptions.hpp>
+#include <jaffarCommon/json.hpp>
+#include <jaffarCommon/file.hpp>
+#include "emuInstance.hpp"
+#include "testRunner.hpp"
+#include "argumentParser.hpp"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#ifdef JAFFAR_USE_NUMA
+  #include <numa.h>
+#endif
+
+// Runs a manifest of (test script, sequence) jobs over a pool of tester processes, one per worker slot.
+// The emulator core relies on process-wide state, so jobs are isolated in their own processes rather than threads.
+// Each worker slot is pinned to a CPU and, if built with libnuma, prefers memory from that CPU's NUMA node.
+// In zygote mode, the emulator is booted only once per test script, by a zygote process that then forks an already
+// initialized copy of itself for each of the script's jobs. The copies share the rom, the core and the booted memory
+// copy-on-write, so that a job starts in milliseconds instead of seconds.
+
+struct job_t
+{
+  std::string scriptFile;
+  std::string sequenceFile;
+  std::string cycleType;
+  size_t branchFactor = _DEFAULT_BRANCH_FACTOR;
+  std::string expectedHash;
+  std::string workingDirectory;
+};
+
+struct worker_t
+{
+  int cpu;
+  int numaNode;
+  pid_t pid;
+  size_t jobId;
+  std::chrono::steady_clock::time_point startTime;
+};
+
+struct zygote_t
+{
+  pid_t pid = -1;
+
+  // Job requests ("<job id> <worker id>") go down the request pipe, and the pid of each launched job comes back
+  int requestFd = -1;
+  FILE *responseFile = nullptr;
+
+  // Jobs of the zygote's script not yet launched. The zygote is closed down after the last one
+  size_t pendingJobs = 0;
+  std::string logFile;
+};
+
+// Lists the CPUs this process may run on. If NUMA information is available, they are interleaved across nodes,
+// so that a partial pool spreads its memory traffic over all of them
+static std::vector<std::pair<int, int>> getWorkerCPUs()
+{
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuSet) != 0) JAFFAR_THROW_RUNTIME("Could not get CPU affinity\n");
+
+  std::vector<std::vector<int>> nodeCPUs(1);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &cpuSet))
+  {
+    int node = 0;
+#ifdef JAFFAR_USE_NUMA
+    if (numa_available() >= 0) node = std::max(0, numa_node_of_cpu(cpu));
+#endif
+    if ((size_t)node >= nodeCPUs.size()) nodeCPUs.resize(node + 1);
+    nodeCPUs[node].push_back(cpu);
+  }
+
+  std::vector<std::pair<int, int>> cpus;
+  for (size_t i = 0; cpus.size() < (size_t)CPU_COUNT(&cpuSet); i++)
+    for (size_t node = 0; node < nodeCPUs.size(); node++)
+      if (i < nodeCPUs[node].size()) cpus.push_back({ nodeCPUs[node][i], nodeCPUs.size() > 1 ? (int)node : -1 });
+
+  return cpus;
+}
+
+// Pins the calling process to a worker's CPU and NUMA node. Both are kept across fork and exec
+static void pinWorker(const worker_t &worker)
+{
+  cpu_set_t cpuSet;
+  CPU_ZERO(&cpuSet);
+  CPU_SET(worker.cpu, &cpuSet);
+  sched_setaffinity(0, sizeof(cpu_set_t), &cpuSet);
+#ifdef JAFFAR_USE_NUMA
+  if (worker.numaNode >= 0 && numa_available() >= 0) numa_set_preferred(worker.numaNode);
+#endif
+}
+
+// Sends the calling process' output to the given log file
+static void redirectOutput(const std::string &logFile)
+{
+  const int logFd = open(logFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (logFd >= 0) { dup2(logFd, STDOUT_FILENO); dup2(logFd, STDERR_FILENO); close(logFd); }
+}
+
+static pid_t launchJob(const worker_t &worker, const std::string &testerPath, const job_t &job, const std::string &resultFile, const std::string &logFile, const std::string &romHashCacheDirectory)
+{
+  const pid_t pid = fork();
+  if (pid < 0) JAFFAR_THROW_RUNTIME("Could not fork worker process\n");
+  if (pid > 0) return pid;
+
+  // Worker process: pinning it and sending the tester's output to the job's log
+  pinWorker(worker);
+  redirectOutput(logFile);
+
+  // Test scripts refer to their files relative to their own location
+  if (chdir(job.workingDirectory.c_str()) != 0) _exit(127);
+
+  const auto branchFactorString = std::to_string(job.branchFactor);
+  std::vector<const char *> args = { testerPath.c_str(), job.scriptFile.c_str(), job.sequenceFile.c_str(), "--cycleType", job.cycleType.c_str(), "--branchFactor", branchFactorString.c_str(), "--resultOutputFile", resultFile.c_str() };
+  if (romHashCacheDirectory != "") { args.push_back("--romHashCacheDirectory"); args.push_back(romHashCacheDirectory.c_str()); }
+  args.push_back(nullptr);
+  execv(testerPath.c_str(), (char *const *)args.data());
+  _exit(127);
+}
+
+// Job process forked from a zygote: runs the job on the zygote's initialized emulator instance, with the tester's default settings
+// except for those the job specifies
+[[noreturn]] static void runZygoteJob(jaffar::EmuInstance &e, const nlohmann::json &configJs, const worker_t &worker, const job_t &job, const std::string &resultFile, const std::string &logFile)
+{
+  pinWorker(worker);
+  redirectOutput(logFile);
+
+  try
+  {
+    jaffar::testRunner::options_t options;
+    options.scriptFilePath = job.scriptFile;
+    options.sequenceFilePath = job.sequenceFile;
+    options.cycleType = job.cycleType;
+    options.branchFactor = job.branchFactor;
+    options.resultOutputFile = resultFile;
+    if (jaffar::testRunner::isCycleTypeRecognized(job.cycleType) == false) JAFFAR_THROW_LOGIC("Unrecognized cycle type: %s\n", job.cycleType.c_str());
+
+    e.resumeWorkerThreads();
+    jaffar::testRunner::run(e, configJs, options);
+  }
+  catch (const std::exception &err)
+  {
+    fprintf(stderr, "%s", err.what());
+    fflush(stdout);
+    _exit(1);
+  }
+
+  // Leaving without unloading the game, as the zygote's copy is discarded along with the process
+  fflush(stdout);
+  _exit(0);
+}
+
+// Zygote process: boots the emulator for a test script, then serves job requests until its request pipe is closed.
+// Each job is forked through an intermediate process that exits right away, so that the job gets adopted by the
+// batch tester (a child subreaper) and can be waited for like any other worker process
+[[noreturn]] static void runZygote(const std::string &scriptFile, const std::string &workingDirectory, const int requestFd, const int responseFd, const std::string &logFile, const std::string &romHashCacheDirectory, const std::vector<job_t> &jobs, const std::vector<worker_t> &workers, const std::function<std::string(const size_t, const char *)> &getJobFile)
+{
+  redirectOutput(logFile);
+  if (chdir(workingDirectory.c_str()) != 0) _exit(127);
+
+  try
+  {
+    // Loading script file
+    std::string configJsRaw;
+    if (jaffarCommon::file::loadStringFromFile(configJsRaw, scriptFile) == false) JAFFAR_THROW_LOGIC("Could not find/read script file: %s\n", scriptFile.c_str());
+    const auto configJs = nlohmann::json::parse(configJsRaw);
+
+    // Booting the emulator into the script's initial state, and stopping its worker threads, as they would not be forked
+    auto e = jaffar::EmuInstance(configJs);
+    e.setRomHashCacheDirectory(romHashCacheDirectory);
+    jaffar::testRunner::initializeEmulator(e, configJs);
+    e.suspendWorkerThreads();
+
+    printf("[] Zygote ready for script:                '%s'\n", scriptFile.c_str());
+    fflush(stdout);
+
+    auto requestFile = fdopen(requestFd, "r");
+    size_t jobId;
+    size_t workerId;
+    while (fscanf(requestFile, "%lu %lu", &jobId, &workerId) == 2)
+    {
+      const pid_t intermediatePid = fork();
+      if (intermediatePid < 0) JAFFAR_THROW_RUNTIME("Could not fork job process\n");
+      if (intermediatePid == 0)
+      {
+        const pid_t jobPid = fork();
+        if (jobPid != 0) { dprintf(responseFd, "%d\n", (int)jobPid); _exit(0); }
+
+        fclose(requestFile);
+        close(responseFd);
+        runZygoteJob(e, configJs, workers[workerId], jobs[jobId], getJobFile(jobId, ".json"), getJobFile(jobId, ".log"));
+      }
+      waitpid(intermediatePid, nullptr, 0);
+    }
+  }
+  catch (const std::exception &err)
+  {
+    fprintf(stderr, "%s", err.what());
+    _exit(1);
+  }
+
+  _exit(0);
+}
+
+static void startZygote(zygote_t &zygote, const std::string &scriptFile, const std::string &workingDirectory, const std::string &romHashCacheDirectory, std::map<std::string, zygote_t> &zygotes, const std::vector<job_t> &jobs, const std::vector<worker_t> &workers, const std::function<std::string(const size_t, const char *)> &getJobFile)
+{
+  int requestPipe[2];
+  int responsePipe[2];
+  if (pipe(requestPipe) != 0 || pipe(responsePipe) != 0) JAFFAR_THROW_RUNTIME("Could not create zygote pipes\n");
+
+  fflush(stdout);
+  zygote.pid = fork();
+  if (zygote.pid < 0) JAFFAR_THROW_RUNTIME("Could not fork zygote process\n");
+  if (zygote.pid == 0)
+  {
+    // Dropping the other zygotes' pipe ends, so that they still see theirs being closed
+    for (auto &entry : zygotes) if (entry.second.requestFd >= 0) { close(entry.second.requestFd); fclose(entry.second.responseFile); }
+    close(requestPipe[1]);
+    close(responsePipe[0]);
+    runZygote(scriptFile, workingDirectory, requestPipe[0], responsePipe[1], zygote.logFile, romHashCacheDirectory, jobs, workers, getJobFile);
+  }
+
+  close(requestPipe[0]);
+  close(responsePipe[1]);
+  zygote.requestFd = requestPipe[1];
+  zygote.responseFile = fdopen(responsePipe[0], "r");
+}
+
+// Requests a job from its script's zygote, starting the zygote first if needed. This waits for the zygote to boot.
+// Returns the job's pid, or -1 if the zygote is not available (e.g., it failed to boot)
+static pid_t launchZygoteJob(const size_t workerId, const size_t jobId, const std::string &romHashCacheDirectory, std::map<std::string, zygote_t> &zygotes, const std::vector<job_t> &jobs, const std::vector<worker_t> &workers, const std::function<std::string(const size_t, const char *)> &getJobFile)
+{
+  const auto &job = jobs[jobId];
+  auto &zygote = zygotes[job.scriptFile];
+  if (zygote.pid < 0) startZygote(zygote, job.scriptFile, job.workingDirectory, romHashCacheDirectory, zygotes, jobs, workers, getJobFile);
+
+  pid_t pid = -1;
+  if (dprintf(zygote.requestFd, "%lu %lu\n", jobId, workerId) > 0 && fscanf(zygote.responseFile, "%d", &pid) != 1) pid = -1;
+
+  // Closing the zygote down after its script's last job
+  if (--zygote.pendingJobs == 0)
+  {
+    close(zygote.requestFd);
+    fclose(zygote.responseFile);
+    zygote.requestFd = -1;
+    zygote.responseFile = nullptr;
+  }
+
+  // Leaving a note in the job's log, as it never got to write one
+  if (pid < 0) jaffarCommon::file::saveStringToFile("Zygote not available, see its log: " + zygote.logFile + "\n", getJobFile(jobId, ".log"));
+
+  return pid;
+}
+
+int main(int argc, char *argv[])
+{
+  // Parsing command line arguments
+  argparse::ArgumentParser program("batchTester", "1.0");
+
+  program.add_argument("manifestFile")
+    .help("Path to the JSON manifest listing the jobs to run: { \"Jobs\": [ { \"Script File\": ..., \"Sequence File\": ..., \"Cycle Type\": (optional), \"Branch Factor\": (optional), \"Expected Hash\": (optional) } ] }. Paths are relative to the manifest's directory.")
+    .required();
+
+  program.add_argument("--tester")
+    .help("Path to the tester executable. By default, the one next to this executable.")
+    .default_value(std::string(""));
+
+  program.add_argument("--workers")
+    .help("Number of worker processes. By default, one per available CPU.")
+    .default_value(std::string(""));
+
+  program.add_argument("--cycleType")
+    .help("Cycle type for the jobs that do not specify their own.")
+    .default_value(std::string("Simple"));
+
+  program.add_argument("--branchFactor")
+    .help("Branch factor for the 'Branch' jobs that do not specify their own.")
+    .default_value(std::to_string(_DEFAULT_BRANCH_FACTOR));
+
+  program.add_argument("--outputDir")
+    .help("Directory to store each job's results and log in.")
+    .default_value(std::string("batchResults"));
+
+  program.add_argument("--reportOutputFile")
+    .help("Path to write the aggregated report to, as JSON.")
+    .default_value(std::string(""));
+
+  program.add_argument("--romHashCacheDirectory")
+    .help("Directory to keep rom image hashes in across runs, so that jobs do not hash the same image again.")
+    .default_value(std::string(""));
+
+  program.add_argument("--zygote")
+  .help("Boots the emulator once per test script and forks it for each of the script's jobs, instead of running a tester process per job. Jobs run with the tester's default settings")
+  .default_value(false)
+  .implicit_value(true);
+
+  // Try to parse arguments
+  try { program.parse_args(argc, argv); } catch (const std::runtime_error &err) { JAFFAR_THROW_LOGIC("%s\n%s", err.what(), program.help().str().c_str()); }
+
+  const auto manifestFilePath = program.get<std::string>("manifestFile");
+  const auto defaultCycleType = program.get<std::string>("--cycleType");
+  const auto defaultBranchFactorString = program.get<std::string>("--branchFactor");
+  size_t defaultBranchFactor = 0;
+  if (jaffar::argumentParser::parseUnsigned(defaultBranchFactorString, defaultBranchFactor) == false) JAFFAR_THROW_LOGIC("Invalid branch factor: %s\n", defaultBranchFactorString.c_str());
+  const auto outputDir = std::filesystem::absolute(program.get<std::string>("--outputDir"));
+  const auto reportOutputFile = program.get<std::string>("--reportOutputFile");
+  const auto useZygote = program.get<bool>("--zygote");
+  auto romHashCacheDirectory = program.get<std::string>("--romHashCacheDirectory");
+  if (romHashCacheDirectory != "") romHashCacheDirectory = std::filesystem::absolute(romHashCacheDirectory).string();
+
+  // Getting tester path
+  auto testerPath = program.get<std::string>("--tester");
+  if (testerPath == "") testerPath = (std::filesystem::read_symlink("/proc/self/exe").parent_path() / "tester").string();
+  testerPath = std::filesystem::absolute(testerPath).string();
+  if (useZygote == false && access(testerPath.c_str(), X_OK) != 0) JAFFAR_THROW_LOGIC("Could not find tester executable: %s\n", testerPath.c_str());
+
+  // Loading manifest
+  std::string manifestRaw;
+  if (jaffarCommon::file::loadStringFromFile(manifestRaw, manifestFilePath) == false) JAFFAR_THROW_LOGIC("Could not find/read manifest file: %s\n", manifestFilePath.c_str());
+  const auto manifestJs = nlohmann::json::parse(manifestRaw);
+  const auto manifestDirectory = std::filesystem::absolute(manifestFilePath).parent_path().string();
+
+  std::vector<job_t> jobs;
+  for (const auto &entry : jaffarCommon::json::getArray<nlohmann::json>(manifestJs, "Jobs"))
+  {
+    job_t job;
+    job.scriptFile = jaffarCommon::json::getString(entry, "Script File");
+    job.sequenceFile = jaffarCommon::json::getString(entry, "Sequence File");
+    job.cycleType = entry.contains("Cycle Type") ? jaffarCommon::json::getString(entry, "Cycle Type") : defaultCycleType;
+    job.branchFactor = entry.contains("Branch Factor") ? jaffarCommon::json::getNumber<size_t>(entry, "Branch Factor") : defaultBranchFactor;
+    if (job.branchFactor == 0) JAFFAR_THROW_LOGIC("The branch factor must be at least 1 (job %lu)\n", jobs.size());
+    job.expectedHash = entry.contains("Expected Hash") ? jaffarCommon::json::getString(entry, "Expected Hash") : "";
+    job.workingDirectory = manifestDirectory;
+    jobs.push_back(job);
+  }
+
+  // Creating worker slots, one per CPU
+  const auto cpus = getWorkerCPUs();
+  const auto workersString = program.get<std::string>("--workers");
+  size_t workerCount = cpus.size();
+  if (workersString != "" && jaffar::argumentParser::parseUnsigned(workersString, workerCount) == false) JAFFAR_THROW_LOGIC("Invalid worker count: %s\n", workersString.c_str());
+  if (workerCount == 0) JAFFAR_THROW_LOGIC("The worker count must be at least 1\n");
+  workerCount = std::min(workerCount, std::max((size_t)1, jobs.size()));
+
+  std::vector<worker_t> workers(workerCount);
+  for (size_t i = 0; i < workerCount; i++)
+  {
+    workers[i].cpu = cpus[i % cpus.size()].first;
+    workers[i].numaNode = cpus[i % cpus.size()].second;
+    workers[i].pid = -1;
+  }
+
+  std::filesystem::create_directories(outputDir);
+  const std::function<std::string(const size_t, const char *)> getJobFile = [&](const size_t jobId, const char *extension) { return (outputDir / ("job" + std::to_string(jobId) + extension)).string(); };
+
+  // Setting up a zygote per test script, each to be started along with its first job
+  std::map<std::string, zygote_t> zygotes;
+  if (useZygote == true)
+  {
+    for (const auto &job : jobs) zygotes[job.scriptFile].pendingJobs++;
+    size_t zygoteId = 0;
+    for (auto &entry : zygotes) entry.second.logFile = (outputDir / ("zygote" + std::to_string(zygoteId++) + ".log")).string();
+
+    // Adopting the job processes once their intermediate parents exit, and surviving writes to a dead zygote's pipe
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) != 0) JAFFAR_THROW_RUNTIME("Could not become a child subreaper\n");
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  printf("[] -----------------------------------------\n");
+  printf("[] Manifest File:                          '%s'\n", manifestFilePath.c_str());
+  printf("[] Tester:                                 '%s'\n", testerPath.c_str());
+  printf("[] Jobs:                                   %lu\n", jobs.size());
+  printf("[] Workers:                                %lu\n", workerCount);
+  if (useZygote == true) printf("[] Zygotes:                                %lu\n", zygotes.size());
+#ifdef JAFFAR_USE_NUMA
+  printf("[] NUMA Nodes:                             %d\n", numa_available() >= 0 ? numa_num_configured_nodes() : 0);
+#endif
+  printf("[] Output Directory:                       '%s'\n", outputDir.c_str());
+  printf("[] ********** Running Jobs **********\n");
+  fflush(stdout);
+
+  // Running jobs, starting a new one whenever a worker finishes. Results are reported as they come
+  nlohmann::json jobResults = nlohmann::json::array();
+  size_t nextJobId = 0;
+  size_t runningJobs = 0;
+  size_t passedJobs = 0;
+  size_t totalInputs = 0;
+  auto t0 = std::chrono::steady_clock::now();
+
+  // Collects the results of a finished job, given its exit status
+  const auto collectJob = [&](const worker_t &worker, const int status)
+  {
+    const auto &job = jobs[worker.jobId];
+    const double jobTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - worker.startTime).count();
+
+    // Collecting the tester's results
+    nlohmann::json result;
+    result["Job"] = worker.jobId;
+    result["Script File"] = job.scriptFile;
+    result["Sequence File"] = job.sequenceFile;
+    result["Cycle Type"] = job.cycleType;
+    if (job.cycleType == "Branch") result["Branch Factor"] = job.branchFactor;
+    result["CPU"] = worker.cpu;
+    result["Wall Time"] = jobTime;
+    result["Log File"] = getJobFile(worker.jobId, ".log");
+
+    std::string jobStatus = "Failed";
+    std::string testerResultsRaw;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && jaffarCommon::file::loadStringFromFile(testerResultsRaw, getJobFile(worker.jobId, ".json")))
+    {
+      const auto testerResults = nlohmann::json::parse(testerResultsRaw);
+      result["Results"] = testerResults;
+      const auto finalHash = jaffarCommon::json::getString(testerResults, "Final State Hash");
+      if (job.expectedHash == "" || job.expectedHash == finalHash) jobStatus = "Passed";
+      else jobStatus = "Hash Mismatch";
+      totalInputs += jaffarCommon::json::getNumber<size_t>(testerResults, "Sequence Length");
+    }
+    else if (WIFSIGNALED(status)) result["Signal"] = WTERMSIG(status);
+    else if (WIFEXITED(status)) result["Exit Code"] = WEXITSTATUS(status);
+
+    result["Status"] = jobStatus;
+    if (jobStatus == "Passed") passedJobs++;
+
+    printf("[] [%lu/%lu] CPU %3d - %-13s - '%s' + '%s' (%s) - %.2fs\n", jobResults.size() + 1, jobs.size(), worker.cpu, jobStatus.c_str(), job.scriptFile.c_str(), job.sequenceFile.c_str(), job.cycleType.c_str(), jobTime);
+    fflush(stdout);
+    jobResults.push_back(result);
+  };
+
+  while (nextJobId < jobs.size() || runningJobs > 0)
+  {
+    for (size_t workerId = 0; workerId < workers.size(); workerId++) while (workers[workerId].pid < 0 && nextJobId < jobs.size())
+    {
+      auto &worker = workers[workerId];
+      worker.jobId = nextJobId++;
+      worker.startTime = std::chrono::steady_clock::now();
+      std::filesystem::remove(getJobFile(worker.jobId, ".json"));
+      if (useZygote == true) worker.pid = launchZygoteJob(workerId, worker.jobId, romHashCacheDirectory, zygotes, jobs, workers, getJobFile);
+      else worker.pid = launchJob(worker, testerPath, jobs[worker.jobId], getJobFile(worker.jobId, ".json"), getJobFile(worker.jobId, ".log"), romHashCacheDirectory);
+
+      // A job that could not be launched fails right away, leaving its worker free for the next one
+      if (worker.pid < 0) { collectJob(worker, W_EXITCODE(1, 0)); continue; }
+      runningJobs++;
+    }
+
+    // Nothing to wait for if every launch failed
+    if (runningJobs == 0) continue;
+
+    int status;
+    const pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) JAFFAR_THROW_RUNTIME("Error waiting for worker processes\n");
+
+    // Zygotes exiting are not jobs
+    auto worker = std::find_if(workers.begin(), workers.end(), [pid](const worker_t &w) { return w.pid == pid; });
+    if (worker == workers.end()) continue;
+    worker->pid = -1;
+    runningJobs--;
+
+    collectJob(*worker, status);
+  }
+
+  const double elapsedTimeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+  // Printing summary
+  printf("[] ********** Summary **********\n");
+  printf("[] Passed:                                 %lu / %lu\n", passedJobs, jobs.size());
+  printf("[] Elapsed time:                           %3.3fs\n", elapsedTimeSeconds);
+  printf("[] Aggregate Performance:                  %.3f inputs / s\n", (double)totalInputs / elapsedTimeSeconds);
+
+  // If saving the report, do it now
+  if (reportOutputFile != "")
+  {
+    nlohmann::json report;
+    report["Manifest File"] = manifestFilePath;
+    report["Workers"] = workerCount;
+    report["Jobs"] = jobResults;
+    report["Passed"] = passedJobs;
+    report["Failed"] = jobs.size() - passedJobs;
+    report["Elapsed Time"] = elapsedTimeSeconds;
+    report["Total Inputs"] = totalInputs;
+    report["Aggregate Inputs Per Second"] = (double)totalInputs / elapsedTimeSeconds;
+    if (jaffarCommon::file::saveStringToFile(report.dump(2), reportOutputFile.c_str()) == false) JAFFAR_THROW_RUNTIME("Could not write report file: %s\n", reportOutputFile.c_str());
+  }
+
+  // Failing if any job did
+  return passedJobs == jobs.size() ? 0 : 1;
+}
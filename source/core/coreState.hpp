@@ -0,0 +1,169 @@
+#pragma once
+
+// Access to the core's state components, bypassing retro_serialize.
+// The state is indexed into named blocks, following what PPSSPP's SaveState::SaveStart::DoState does,
+// so that callers can serialize only the blocks they need ('lite' states) or handle guest memory on their own
+// (e.g., by copying back only the pages that changed).
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <jaffarCommon/exceptions.hpp>
+#include <Common/Serialize/Serializer.h>
+#include <Core/MemMap.h>
+#include <Core/CoreTiming.h>
+#include <Core/MIPS/MIPS.h>
+#include <Core/MIPS/JitCommon/JitCommon.h>
+#include <Core/HLE/HLE.h>
+#include <Core/HLE/ReplaceTables.h>
+#include <Core/HLE/sceKernel.h>
+#include <Core/HW/MemoryStick.h>
+#include <Core/FileSystems/MetaFileSystem.h>
+
+namespace jaffar
+{
+
+namespace coreState
+{
+
+// State blocks, in serialization order
+enum block_t
+{
+  coreTiming = 0, // Scheduled timing events
+  ram,            // Guest main memory
+  vram,           // Video memory, including framebuffers
+  scratchpad,     // Scratchpad memory
+  memoryStick,    // Memory stick status
+  cpu,            // MIPS registers and CPU state
+  hle,            // HLE module state
+  kernel,         // Kernel objects, including the GPU, display and audio modules
+  fileSystem,     // Open files and mounted devices
+  blockCount
+};
+
+static const char *blockNames[blockCount] = { "CoreTiming", "RAM", "VRAM", "Scratchpad", "MemoryStick", "CPU", "HLE", "Kernel", "FileSystem" };
+
+// Masks of state blocks
+typedef uint32_t blockMask_t;
+static constexpr blockMask_t allBlocks = (1u << blockCount) - 1;
+static constexpr blockMask_t memoryBlocks = (1u << ram) | (1u << vram) | (1u << scratchpad);
+static constexpr blockMask_t systemBlocks = allBlocks & ~memoryBlocks;
+
+inline bool isBlockEnabled(const blockMask_t mask, const block_t block) { return (mask >> block) & 1; }
+
+// Gets the block that corresponds to the given name. Throws if it does not exist
+inline block_t getBlock(const std::string &name)
+{
+  for (size_t i = 0; i < blockCount; i++)
+    if (name == blockNames[i]) return (block_t)i;
+
+  std::string possibleValues;
+  for (size_t i = 0; i < blockCount; i++) possibleValues += std::string(" '") + blockNames[i] + "'";
+  JAFFAR_THROW_LOGIC("Unrecognized state block: '%s'. Possible values:%s\n", name.c_str(), possibleValues.c_str());
+
+  return blockCount;
+}
+
+// Runs the given copy operation over guest memory with the JIT's emulation hacks removed from it,
+// so that the copied memory does not refer to compiled blocks (same as the core does for its savestates)
+template <typename F>
+inline void withoutEmuHacks(const F &copyOperation)
+{
+  std::lock_guard<std::recursive_mutex> guard(MIPSComp::jitLock);
+  if (MIPSComp::jit == nullptr) { copyOperation(); return; }
+
+  auto savedBlocks = MIPSComp::jit->SaveAndClearEmuHackOps();
+  copyOperation();
+  MIPSComp::jit->RestoreSavedEmuHackOps(savedBlocks);
+}
+
+// Runs the given copy operation over guest memory with the HLE function replacements taken out of it, and puts them back
+// afterwards. The core does this around its savestate memory in both directions, so saved memory holds the original
+// instructions and loaded memory gets the replacements back
+template <typename F>
+inline void withoutReplacements(const F &copyOperation)
+{
+  const auto savedReplacements = SaveAndClearReplacements();
+  copyOperation();
+  RestoreSavedReplacements(savedReplacements);
+}
+
+// Discards all compiled blocks, restoring the original instructions in guest memory
+inline void clearJitCache()
+{
+  std::lock_guard<std::recursive_mutex> guard(MIPSComp::jitLock);
+  if (MIPSComp::jit != nullptr) MIPSComp::jit->ClearCache();
+}
+
+inline void doMemoryBlock(PointerWrap &p, const block_t block, const uint32_t address, uint32_t size)
+{
+  auto section = p.Section(blockNames[block], 1);
+  if (!section) return;
+
+  // The memory size is stored to detect incompatible states
+  uint32_t storedSize = size;
+  p.DoVoid(&storedSize, sizeof(storedSize));
+  if (storedSize != size) { p.SetError(PointerWrap::ERROR_FAILURE); return; }
+
+  auto ptr = Memory::GetPointerWriteUnchecked(address);
+  withoutReplacements([&]()
+  {
+    if (p.mode == PointerWrap::MODE_WRITE) withoutEmuHacks([&]() { p.DoVoid(ptr, size); });
+    else p.DoVoid(ptr, size);
+  });
+}
+
+inline void doBlock(PointerWrap &p, const block_t block)
+{
+  switch (block)
+  {
+    case coreTiming: CoreTiming::DoState(p); break;
+    case ram: doMemoryBlock(p, block, PSP_GetKernelMemoryBase(), Memory::g_MemorySize); break;
+    case vram: doMemoryBlock(p, block, PSP_GetVidMemBase(), PSP_GetVidMemEnd() - PSP_GetVidMemBase()); break;
+    case scratchpad: doMemoryBlock(p, block, PSP_GetScratchpadMemoryBase(), PSP_GetScratchpadMemoryEnd() - PSP_GetScratchpadMemoryBase()); break;
+    case memoryStick: MemoryStick_DoState(p); break;
+    case cpu: currentMIPS->DoState(p); break;
+    case hle: HLEDoState(p); break;
+    case kernel: __KernelDoState(p); break;
+    case fileSystem: pspFileSystem.DoState(p); break;
+    default: break;
+  }
+}
+
+inline void doBlocks(PointerWrap &p, const blockMask_t mask)
+{
+  for (size_t i = 0; i < blockCount; i++)
+    if (isBlockEnabled(mask, (block_t)i)) doBlock(p, (block_t)i);
+}
+
+inline size_t measure(const blockMask_t mask)
+{
+  uint8_t *ptr = nullptr;
+  PointerWrap p(&ptr, 0, PointerWrap::MODE_MEASURE);
+  doBlocks(p, mask);
+  return (size_t)ptr;
+}
+
+inline bool save(uint8_t *buffer, const size_t size, const blockMask_t mask)
+{
+  uint8_t *ptr = buffer;
+  PointerWrap p(&ptr, size, PointerWrap::MODE_WRITE);
+  doBlocks(p, mask);
+  return p.error != PointerWrap::ERROR_FAILURE;
+}
+
+inline bool load(uint8_t *buffer, const size_t size, const blockMask_t mask)
+{
+  // Loaded memory is free of emulation hacks, so compiled code needs to go
+  if (mask & memoryBlocks) clearJitCache();
+
+  uint8_t *ptr = buffer;
+  PointerWrap p(&ptr, size, PointerWrap::MODE_READ);
+  doBlocks(p, mask);
+  return p.error != PointerWrap::ERROR_FAILURE;
+}
+
+} // namespace coreState
+
+} // namespace jaffar
@@ -0,0 +1,167 @@
+#pragma once
+
+// Dirty page tracker for guest memory
+// It relies on Linux soft-dirty bits: writing '4' to /proc/self/clear_refs clears them for the whole process,
+// and bit 55 of each /proc/self/pagemap entry tells whether the page has been written since.
+// Since clearing is process-wide, each consumer (e.g., hashing, state restore) keeps its own accumulated
+// dirty page flags, which are updated together every time the soft-dirty bits are collected.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace jaffar
+{
+
+#define _PAGEMAP_ENTRY_SIZE 8
+#define _PAGEMAP_SOFT_DIRTY_BIT 55
+
+class DirtyPageTracker
+{
+  public:
+
+  DirtyPageTracker() : _pageSize(sysconf(_SC_PAGESIZE)) {}
+
+  ~DirtyPageTracker()
+  {
+    if (_pagemapFd >= 0) close(_pagemapFd);
+    if (_clearRefsFd >= 0) close(_clearRefsFd);
+  }
+
+  // Opens the kernel interfaces and verifies that soft-dirty tracking actually works on this system
+  bool initialize()
+  {
+    _pagemapFd = open("/proc/self/pagemap", O_RDONLY);
+    _clearRefsFd = open("/proc/self/clear_refs", O_WRONLY);
+    if (_pagemapFd < 0 || _clearRefsFd < 0) return false;
+
+    // Probing with a freshly mapped page: it should become clean after clearing and dirty after a write
+    auto probe = (volatile uint8_t *)mmap(nullptr, _pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (probe == MAP_FAILED) return false;
+    probe[0] = 1;
+    clearSoftDirtyBits();
+    bool isCleanAfterClear = isPageSoftDirty((const uint8_t *)probe) == false;
+    probe[0] = 2;
+    bool isDirtyAfterWrite = isPageSoftDirty((const uint8_t *)probe) == true;
+    munmap((void *)probe, _pageSize);
+
+    _isSupported = isCleanAfterClear && isDirtyAfterWrite;
+    return _isSupported;
+  }
+
+  bool isSupported() const { return _isSupported; }
+  size_t getPageSize() const { return _pageSize; }
+
+  // Registers a memory range to track. Aliases are other virtual addresses mapping the same memory
+  // (e.g., guest memory mirrors); a page is considered dirty if it was written through any of them.
+  size_t addRange(const uint8_t *ptr, const size_t size, const std::vector<const uint8_t *> &aliases = {})
+  {
+    range_t range;
+    range.start = alignDown(ptr);
+    range.pageCount = (alignUp(ptr + size) - range.start) / _pageSize;
+    range.views.push_back(range.start);
+    for (const auto alias : aliases) range.views.push_back(alignDown(alias));
+    _ranges.push_back(range);
+
+    // Existing consumers start by considering the whole new range as dirty
+    for (auto &consumer : _consumers) consumer.push_back(std::vector<uint8_t>(range.pageCount, 1));
+
+    if (range.pageCount > _pagemapBuffer.size()) _pagemapBuffer.resize(range.pageCount);
+    return _ranges.size() - 1;
+  }
+
+  // Registers a new consumer of dirty page information. Initially, all its pages are considered dirty
+  size_t addConsumer()
+  {
+    std::vector<std::vector<uint8_t>> consumer;
+    for (const auto &range : _ranges) consumer.push_back(std::vector<uint8_t>(range.pageCount, 1));
+    _consumers.push_back(consumer);
+    return _consumers.size() - 1;
+  }
+
+  // Collects the soft-dirty bits of all tracked ranges into every consumer, and clears them for the process
+  void update()
+  {
+    for (size_t rangeId = 0; rangeId < _ranges.size(); rangeId++)
+    {
+      const auto &range = _ranges[rangeId];
+      for (const auto view : range.views)
+      {
+        if (readPagemap(view, range.pageCount) == false) continue;
+
+        for (size_t i = 0; i < range.pageCount; i++)
+          if ((_pagemapBuffer[i] >> _PAGEMAP_SOFT_DIRTY_BIT) & 1)
+            for (auto &consumer : _consumers) consumer[rangeId][i] = 1;
+      }
+    }
+
+    clearSoftDirtyBits();
+  }
+
+  const std::vector<uint8_t> &getDirtyPages(const size_t consumerId, const size_t rangeId) const { return _consumers[consumerId][rangeId]; }
+  const uint8_t *getRangeStart(const size_t rangeId) const { return _ranges[rangeId].start; }
+
+  // Marks all pages of a consumer as clean, after it has processed them
+  void resetConsumer(const size_t consumerId)
+  {
+    for (auto &pages : _consumers[consumerId]) std::fill(pages.begin(), pages.end(), 0);
+  }
+
+  // Marks all pages of a consumer as dirty, e.g., after its cached information became invalid
+  void invalidateConsumer(const size_t consumerId)
+  {
+    for (auto &pages : _consumers[consumerId]) std::fill(pages.begin(), pages.end(), 1);
+  }
+
+  private:
+
+  struct range_t
+  {
+    const uint8_t *start;
+    size_t pageCount;
+    std::vector<const uint8_t *> views;
+  };
+
+  const uint8_t *alignDown(const uint8_t *ptr) const { return (const uint8_t *)((uintptr_t)ptr & ~(uintptr_t)(_pageSize - 1)); }
+  const uint8_t *alignUp(const uint8_t *ptr) const { return alignDown(ptr + _pageSize - 1); }
+
+  bool readPagemap(const uint8_t *start, const size_t pageCount)
+  {
+    const size_t readSize = pageCount * _PAGEMAP_ENTRY_SIZE;
+    const off_t offset = ((uintptr_t)start / _pageSize) * _PAGEMAP_ENTRY_SIZE;
+    return pread(_pagemapFd, _pagemapBuffer.data(), readSize, offset) == (ssize_t)readSize;
+  }
+
+  bool isPageSoftDirty(const uint8_t *ptr)
+  {
+    uint64_t entry = 0;
+    const off_t offset = ((uintptr_t)ptr / _pageSize) * _PAGEMAP_ENTRY_SIZE;
+    if (pread(_pagemapFd, &entry, sizeof(entry), offset) != sizeof(entry)) return false;
+    return (entry >> _PAGEMAP_SOFT_DIRTY_BIT) & 1;
+  }
+
+  void clearSoftDirtyBits()
+  {
+    const char command = '4';
+    if (write(_clearRefsFd, &command, 1) != 1) _isSupported = false;
+  }
+
+  const size_t _pageSize;
+  int _pagemapFd = -1;
+  int _clearRefsFd = -1;
+  bool _isSupported = false;
+
+  std::vector<range_t> _ranges;
+
+  // Per consumer, per range, per page dirty flags
+  std::vector<std::vector<std::vector<uint8_t>>> _consumers;
+
+  // Preallocated buffer for pagemap reads
+  std::vector<uint64_t> _pagemapBuffer;
+};
+
+} // namespace jaffar
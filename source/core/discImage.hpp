@@ -0,0 +1,371 @@
+#pragma once
+
+// Disc image readers for the headless CD layer
+// Raw ISO images are read straight from their memory mapping. Compressed images (CSO, CHD) are decompressed
+// block by block on demand into a bounded LRU cache of decompressed blocks. When blocks are missed in sequence,
+// the following ones are decompressed ahead of time, so streaming reads rarely wait on the decompressor.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <jaffarCommon/exceptions.hpp>
+#include <zlib.h>
+#include <libchdr/chd.h>
+#include "romImage.hpp"
+
+namespace jaffar
+{
+
+// Maximum amount of decompressed data kept in the block cache
+#define _DISC_IMAGE_CACHE_SIZE 0x1000000
+
+// Amount of data decompressed ahead of a sequential miss
+#define _DISC_IMAGE_READ_AHEAD_SIZE 0x20000
+
+#define _CSO_HEADER_SIZE 24
+#define _CSO_PLAIN_BLOCK_FLAG 0x80000000u
+
+#define _CHD_DVD_UNIT_SIZE 2048
+
+class DiscImage
+{
+  public:
+
+  virtual ~DiscImage() = default;
+
+  // Size of the uncompressed image
+  virtual uint64_t getSize() const = 0;
+
+  // Copies bytes from the uncompressed image, clamped to its end. Returns the number of bytes copied
+  virtual size_t read(void *buffer, const uint64_t offset, const size_t size) = 0;
+
+  virtual std::string getFormat() const = 0;
+
+  // Creates the reader that corresponds to the image format, recognized by its magic. Returns nullptr on failure
+  static std::unique_ptr<DiscImage> open(const RomImage &romImage);
+};
+
+// Uncompressed image, read directly from the mapping
+class RawDiscImage : public DiscImage
+{
+  public:
+
+  RawDiscImage(const RomImage &romImage) : _romImage(romImage) {}
+
+  uint64_t getSize() const override { return _romImage.getSize(); }
+  size_t read(void *buffer, const uint64_t offset, const size_t size) override { return _romImage.read(buffer, offset, size); }
+  std::string getFormat() const override { return "ISO"; }
+
+  private:
+
+  const RomImage &_romImage;
+};
+
+// Image made of independently compressed blocks, served through an LRU cache of decompressed blocks
+class BlockDiscImage : public DiscImage
+{
+  public:
+
+  uint64_t getSize() const override { return _size; }
+
+  size_t read(void *buffer, const uint64_t offset, const size_t size) override
+  {
+    if (offset >= _size) return 0;
+    const size_t readSize = std::min((uint64_t)size, _size - offset);
+
+    size_t position = 0;
+    while (position < readSize)
+    {
+      const uint64_t currentOffset = offset + position;
+      const size_t blockId = currentOffset / _blockSize;
+      const size_t blockOffset = currentOffset % _blockSize;
+      const size_t copySize = std::min(_blockSize - blockOffset, readSize - position);
+
+      const uint8_t *block = getBlock(blockId);
+      if (block == nullptr) JAFFAR_THROW_RUNTIME("Could not decompress block %lu of the %s image\n", blockId, getFormat().c_str());
+
+      memcpy(&((uint8_t *)buffer)[position], &block[blockOffset], copySize);
+      position += copySize;
+    }
+
+    return readSize;
+  }
+
+  size_t getCacheHits() const { return _cacheHits; }
+  size_t getCacheMisses() const { return _cacheMisses; }
+
+  protected:
+
+  size_t getBlockSize() const { return _blockSize; }
+
+  // Decompresses a single block into the given buffer, of block size
+  virtual bool decompressBlock(const size_t blockId, uint8_t *buffer) = 0;
+
+  void initializeCache(const uint64_t size, const size_t blockSize, const size_t blockCount)
+  {
+    _size = size;
+    _blockSize = blockSize;
+    _blockCount = blockCount;
+    _readAheadBlocks = std::max((size_t)1, (size_t)_DISC_IMAGE_READ_AHEAD_SIZE / _blockSize);
+
+    // The cache must at least hold a missed block together with its read-ahead
+    const size_t slotCount = std::max(_DISC_IMAGE_CACHE_SIZE / _blockSize, 2 * (_readAheadBlocks + 1));
+    _cacheData.resize(slotCount * _blockSize);
+    _slots.resize(slotCount);
+    _usedSlots = 0;
+    _mostRecentSlot = _noSlot;
+    _leastRecentSlot = _noSlot;
+    _slotMap.clear();
+    _slotMap.reserve(slotCount);
+  }
+
+  private:
+
+  static constexpr size_t _noSlot = SIZE_MAX;
+
+  struct slot_t
+  {
+    size_t blockId;
+    size_t previous; // More recently used
+    size_t next;     // Less recently used
+  };
+
+  const uint8_t *getBlock(const size_t blockId)
+  {
+    auto it = _slotMap.find(blockId);
+    if (it != _slotMap.end())
+    {
+      _cacheHits++;
+      touchSlot(it->second);
+      return &_cacheData[it->second * _blockSize];
+    }
+
+    _cacheMisses++;
+    const bool isSequential = blockId == _nextSequentialBlockId;
+    const auto slot = loadBlock(blockId);
+    if (slot == _noSlot) return nullptr;
+    _nextSequentialBlockId = blockId + 1;
+
+    // Decompressing the blocks that follow, if this looks like a sequential read
+    if (isSequential)
+      for (size_t i = blockId + 1; i < std::min(blockId + 1 + _readAheadBlocks, _blockCount); i++)
+      {
+        if (_slotMap.count(i) > 0) continue;
+        if (loadBlock(i) == _noSlot) break;
+        _nextSequentialBlockId = i + 1;
+      }
+
+    // The requested block is used right away, so it goes back in front of its read-ahead
+    touchSlot(slot);
+    return &_cacheData[slot * _blockSize];
+  }
+
+  // Decompresses a block into a free slot, evicting the least recently used one if needed
+  size_t loadBlock(const size_t blockId)
+  {
+    size_t slot;
+    if (_usedSlots < _slots.size()) slot = _usedSlots++;
+    else
+    {
+      slot = _leastRecentSlot;
+      unlinkSlot(slot);
+      _slotMap.erase(_slots[slot].blockId);
+    }
+
+    if (decompressBlock(blockId, &_cacheData[slot * _blockSize]) == false)
+    {
+      // The slot is left unused: reclaim it by making it the next to be evicted
+      _slots[slot].blockId = _noSlot;
+      linkSlotBack(slot);
+      return _noSlot;
+    }
+
+    _slots[slot].blockId = blockId;
+    _slotMap[blockId] = slot;
+    linkSlotFront(slot);
+    return slot;
+  }
+
+  void touchSlot(const size_t slot)
+  {
+    if (slot == _mostRecentSlot) return;
+    unlinkSlot(slot);
+    linkSlotFront(slot);
+  }
+
+  void unlinkSlot(const size_t slot)
+  {
+    auto &s = _slots[slot];
+    if (s.previous != _noSlot) _slots[s.previous].next = s.next; else _mostRecentSlot = s.next;
+    if (s.next != _noSlot) _slots[s.next].previous = s.previous; else _leastRecentSlot = s.previous;
+  }
+
+  void linkSlotFront(const size_t slot)
+  {
+    _slots[slot].previous = _noSlot;
+    _slots[slot].next = _mostRecentSlot;
+    if (_mostRecentSlot != _noSlot) _slots[_mostRecentSlot].previous = slot;
+    _mostRecentSlot = slot;
+    if (_leastRecentSlot == _noSlot) _leastRecentSlot = slot;
+  }
+
+  void linkSlotBack(const size_t slot)
+  {
+    _slots[slot].next = _noSlot;
+    _slots[slot].previous = _leastRecentSlot;
+    if (_leastRecentSlot != _noSlot) _slots[_leastRecentSlot].next = slot;
+    _leastRecentSlot = slot;
+    if (_mostRecentSlot == _noSlot) _mostRecentSlot = slot;
+  }
+
+  uint64_t _size = 0;
+  size_t _blockSize = 0;
+  size_t _blockCount = 0;
+  size_t _readAheadBlocks = 0;
+  size_t _nextSequentialBlockId = 0;
+
+  // Preallocated decompressed block storage and its LRU bookkeeping
+  std::vector<uint8_t> _cacheData;
+  std::vector<slot_t> _slots;
+  std::unordered_map<size_t, size_t> _slotMap;
+  size_t _usedSlots = 0;
+  size_t _mostRecentSlot = _noSlot;
+  size_t _leastRecentSlot = _noSlot;
+
+  size_t _cacheHits = 0;
+  size_t _cacheMisses = 0;
+};
+
+// CISO image: a block index followed by raw deflate streams. Blocks flagged in the index are stored uncompressed
+class CSODiscImage : public BlockDiscImage
+{
+  public:
+
+  CSODiscImage(const RomImage &romImage) : _romImage(romImage) {}
+  ~CSODiscImage() { if (_isStreamInitialized) inflateEnd(&_stream); }
+
+  bool open()
+  {
+    const auto data = _romImage.getData();
+    if (_romImage.getSize() < _CSO_HEADER_SIZE || memcmp(data, "CISO", 4) != 0) return false;
+
+    uint64_t totalBytes;
+    uint32_t blockSize;
+    memcpy(&totalBytes, &data[8], sizeof(totalBytes));
+    memcpy(&blockSize, &data[16], sizeof(blockSize));
+    const uint8_t version = data[20];
+    _indexShift = data[21];
+
+    // Version 2 images may use other codecs
+    if (version > 1 || blockSize == 0 || totalBytes == 0) return false;
+
+    const size_t blockCount = (totalBytes + blockSize - 1) / blockSize;
+    if (_CSO_HEADER_SIZE + (blockCount + 1) * sizeof(uint32_t) > _romImage.getSize()) return false;
+    _index = (const uint32_t *)&data[_CSO_HEADER_SIZE];
+
+    _stream = z_stream{};
+    if (inflateInit2(&_stream, -15) != Z_OK) return false;
+    _isStreamInitialized = true;
+
+    initializeCache(totalBytes, blockSize, blockCount);
+    return true;
+  }
+
+  std::string getFormat() const override { return "CSO"; }
+
+  private:
+
+  bool decompressBlock(const size_t blockId, uint8_t *buffer) override
+  {
+    uint32_t indexStart, indexEnd;
+    memcpy(&indexStart, &_index[blockId], sizeof(uint32_t));
+    memcpy(&indexEnd, &_index[blockId + 1], sizeof(uint32_t));
+
+    const uint64_t start = (uint64_t)(indexStart & ~_CSO_PLAIN_BLOCK_FLAG) << _indexShift;
+    const uint64_t end = (uint64_t)(indexEnd & ~_CSO_PLAIN_BLOCK_FLAG) << _indexShift;
+    if (start > end || end > _romImage.getSize()) return false;
+    const auto compressedData = &_romImage.getData()[start];
+    const size_t compressedSize = end - start;
+
+    if (indexStart & _CSO_PLAIN_BLOCK_FLAG)
+    {
+      memcpy(buffer, compressedData, std::min(compressedSize, getBlockSize()));
+      return true;
+    }
+
+    inflateReset(&_stream);
+    _stream.next_in = (Bytef *)compressedData;
+    _stream.avail_in = compressedSize;
+    _stream.next_out = buffer;
+    _stream.avail_out = getBlockSize();
+    const auto status = inflate(&_stream, Z_FINISH);
+    return status == Z_STREAM_END || _stream.avail_out == 0;
+  }
+
+  const RomImage &_romImage;
+  const uint32_t *_index = nullptr;
+  uint8_t _indexShift = 0;
+  z_stream _stream;
+  bool _isStreamInitialized = false;
+};
+
+// MAME compressed hunks of data, decoded by libchdr. Only DVD-style images (2048-byte units) are supported,
+// which is what chdman's 'createdvd' produces for UMD images.
+class CHDDiscImage : public BlockDiscImage
+{
+  public:
+
+  ~CHDDiscImage() { if (_chd != nullptr) chd_close(_chd); }
+
+  bool open(const std::string &filePath)
+  {
+    if (chd_open(filePath.c_str(), CHD_OPEN_READ, nullptr, &_chd) != CHDERR_NONE) { _chd = nullptr; return false; }
+
+    const auto header = chd_get_header(_chd);
+    if (header->unitbytes != _CHD_DVD_UNIT_SIZE)
+    {
+      fprintf(stderr, "Unsupported CHD unit size: %u (only 2048-byte DVD images are supported)\n", header->unitbytes);
+      return false;
+    }
+
+    initializeCache(header->logicalbytes, header->hunkbytes, header->totalhunks);
+    return true;
+  }
+
+  std::string getFormat() const override { return "CHD"; }
+
+  private:
+
+  bool decompressBlock(const size_t blockId, uint8_t *buffer) override { return chd_read(_chd, blockId, buffer) == CHDERR_NONE; }
+
+  chd_file *_chd = nullptr;
+};
+
+inline std::unique_ptr<DiscImage> DiscImage::open(const RomImage &romImage)
+{
+  const auto data = romImage.getData();
+  const auto size = romImage.getSize();
+
+  if (size >= 4 && memcmp(data, "CISO", 4) == 0)
+  {
+    auto image = std::make_unique<CSODiscImage>(romImage);
+    if (image->open() == false) return nullptr;
+    return image;
+  }
+
+  if (size >= 8 && memcmp(data, "MComprHD", 8) == 0)
+  {
+    auto image = std::make_unique<CHDDiscImage>();
+    if (image->open(romImage.getFilePath()) == false) return nullptr;
+    return image;
+  }
+
+  return std::make_unique<RawDiscImage>(romImage);
+}
+
+} // namespace jaffar
@@ -8,10 +8,22 @@
 #include <jaffarCommon/deserializers/base.hpp>
 #include <jaffarCommon/serializers/contiguous.hpp>
 #include <jaffarCommon/deserializers/contiguous.hpp>
+#include <array>
+#include <map>
+#include <random>
 #include "inputParser.hpp"
+#include "hashKernel.hpp"
+#include "dirtyPageTracker.hpp"
+#include "coreState.hpp"
+#include "telemetry.hpp"
+#include "romImage.hpp"
+#include "discImage.hpp"
 #include <SDL.h>
 #include <libretro.h>
 #include <GPU/GPU.h>
+#include <Core/MemMap.h>
+#include <Common/Thread/ThreadManager.h>
+#include <Common/CPUDetect.h>
 
 extern GPUCommon *gpu;
 
@@ -27,16 +39,45 @@ struct MemoryAreas
 {
 	uint8_t* wram;
   uint8_t* vram;
+  uint8_t* scratchpad;
 };
 
 struct MemorySizes
 {
 	size_t wram;
   size_t vram;
+  size_t scratchpad;
 };
 
+// A contiguous range of guest memory to include in the state hash
+struct hashRegion_t
+{
+  std::string area;
+  size_t offset;
+  size_t size;
+  uint8_t* ptr;
+};
+
+// A page-sized piece of a hash region, whose hash is cached for incremental hashing
+struct hashChunk_t
+{
+  const uint8_t* ptr;
+  size_t size;
+  size_t rangeId;
+  size_t pageId;
+};
+
+// Number of chunk hashes combined into each intermediate node of the hash tree
+#define _HASH_TREE_GROUP_SIZE 64
+
+// Bytes appended to every serialized state, while incremental restore is enabled, to recognize the reference state
+#define _REFERENCE_STATE_TOKEN_SIZE sizeof(uint64_t)
+
+// Lite state sizes are rounded up to this granularity, leaving room for variable-sized blocks (e.g., kernel objects) to grow
+#define _LITE_STATE_SIZE_GRANULARITY 0x100000
+
 #define VIDEO_HORIZONTAL_PIXELS 480
-#define	VIDEO_VERTICAL_PIXELS 270
+#define	VIDEO_VERTICAL_PIXELS 272
 #define _AUDIO_MAX_SAMPLE_COUNT 4096
 
 std::string _compatibilityFileData = "";
@@ -44,7 +85,6 @@ std::string _compatibilityVRFileData = "";
 std::string _ppgeFontFileData = "";
 std::string _atlasFontZimFileData = "";
 std::string _atlasFontMetadataFileData = "";
-bool _readInputs;
 
 extern "C"
 {
@@ -66,39 +106,64 @@ extern "C"
 /// CD Management Logic Start
 #define CDIMAGE_SECTOR_SIZE 2048
 
-std::string _gameData;
+jaffar::RomImage _romImage;
+std::unique_ptr<jaffar::DiscImage> _discImage;
 uint32_t _currentSector = 0;
-uint32_t cd_get_size(void) {  return _gameData.size(); }
+uint32_t cd_get_size(void) {  return _discImage->getSize(); }
 uint32_t cd_get_sector_count(void) {  return cd_get_size() / CDIMAGE_SECTOR_SIZE; }
 void cd_set_sector(const uint32_t sector_) { _currentSector = sector_; }
-void cd_read_sector(void *buf_) {  memcpy(buf_, (uint8_t*)&_gameData.data()[_currentSector * CDIMAGE_SECTOR_SIZE], CDIMAGE_SECTOR_SIZE); }
+void cd_read_sector(void *buf_)
+{
+  // Sectors past the end of the image read as zeros
+  const size_t readSize = _discImage->read(buf_, (uint64_t)_currentSector * CDIMAGE_SECTOR_SIZE, CDIMAGE_SECTOR_SIZE);
+  memset(&((uint8_t*)buf_)[readSize], 0, CDIMAGE_SECTOR_SIZE - readSize);
+}
 size_t readSegmentFromCD(void *buf_, const uint64_t address, const size_t size)
 {
-  uint64_t initialSector = address / CDIMAGE_SECTOR_SIZE;
-  uint64_t sectorCount = size / CDIMAGE_SECTOR_SIZE;
-  uint64_t lastSectorBytes = size % CDIMAGE_SECTOR_SIZE;
+  // The segment is copied straight from the mapped image, or from its decompressed blocks.
+  // Reads are clamped to the end of the image, so the bytes actually read are returned
+  return _discImage->read(buf_, address, size);
+}
+/// CD Management Logic End
 
-  uint8_t tmpBuf[CDIMAGE_SECTOR_SIZE];
-  for (uint64_t i = 0; i < sectorCount; i++)
-  {
-    cd_set_sector(initialSector + i);
-    cd_read_sector(tmpBuf);
-    memcpy(&((uint8_t*)buf_)[CDIMAGE_SECTOR_SIZE * i], tmpBuf, CDIMAGE_SECTOR_SIZE);
-  }
+namespace jaffar
+{
+
+// Maps libretro joypad ids to input button masks. Ids of buttons the PSP does not have map to zero
+constexpr std::array<uint16_t, RETRO_DEVICE_ID_JOYPAD_R3 + 1> makeJoypadIdToMask()
+{
+  std::array<uint16_t, RETRO_DEVICE_ID_JOYPAD_R3 + 1> table{};
+  table[RETRO_DEVICE_ID_JOYPAD_B] = buttonMask(button_t::cross);
+  table[RETRO_DEVICE_ID_JOYPAD_Y] = buttonMask(button_t::square);
+  table[RETRO_DEVICE_ID_JOYPAD_SELECT] = buttonMask(button_t::select);
+  table[RETRO_DEVICE_ID_JOYPAD_START] = buttonMask(button_t::start);
+  table[RETRO_DEVICE_ID_JOYPAD_UP] = buttonMask(button_t::up);
+  table[RETRO_DEVICE_ID_JOYPAD_DOWN] = buttonMask(button_t::down);
+  table[RETRO_DEVICE_ID_JOYPAD_LEFT] = buttonMask(button_t::left);
+  table[RETRO_DEVICE_ID_JOYPAD_RIGHT] = buttonMask(button_t::right);
+  table[RETRO_DEVICE_ID_JOYPAD_A] = buttonMask(button_t::circle);
+  table[RETRO_DEVICE_ID_JOYPAD_X] = buttonMask(button_t::triangle);
+  table[RETRO_DEVICE_ID_JOYPAD_L] = buttonMask(button_t::ltrigger);
+  table[RETRO_DEVICE_ID_JOYPAD_R] = buttonMask(button_t::rtrigger);
+  return table;
+}
+
+static constexpr auto _joypadIdToMask = makeJoypadIdToMask();
 
-  if (lastSectorBytes > 0)
+constexpr uint16_t makeJoypadButtonsMask()
+{
+  uint16_t mask = 0;
+  for (size_t id = 0; id < _joypadIdToMask.size(); id++)
   {
-    cd_set_sector(initialSector + sectorCount);
-    cd_read_sector(tmpBuf);
-    memcpy(&((uint8_t*)buf_)[CDIMAGE_SECTOR_SIZE * sectorCount], tmpBuf, lastSectorBytes);
+    // Each joypad button must sit at the bit of its id for bitmask queries to work
+    if (_joypadIdToMask[id] != 0 && _joypadIdToMask[id] != (1u << id)) return 0;
+    mask |= _joypadIdToMask[id];
   }
-
-  return size;
+  return mask;
 }
-/// CD Management Logic End
 
-namespace jaffar
-{
+static constexpr uint16_t _joypadButtonsMask = makeJoypadButtonsMask();
+static_assert(_joypadButtonsMask != 0, "Input button bits must follow libretro joypad ids");
 
 class EmuInstance;
 thread_local EmuInstance* _instance = nullptr;
@@ -116,34 +181,119 @@ class EmuInstance
     _atlasFontZimFilePath = jaffarCommon::json::getString(config, "Atlas Font Zim File Path");
     _atlasFontMetadataFilePath = jaffarCommon::json::getString(config, "Atlas Font Metadata File Path");
     _inputParser = std::make_unique<jaffar::InputParser>(config);
+
+    // Parsing memory regions to hash. If none are given, all of RAM and VRAM are hashed
+    const auto hashRegions = jaffarCommon::json::getArray<nlohmann::json>(config, "Hash Regions");
+    for (const auto& entry : hashRegions)
+    {
+      hashRegion_t region;
+      region.area = jaffarCommon::json::getString(entry, "Area");
+      region.offset = jaffarCommon::json::getNumber<size_t>(entry, "Offset");
+      region.size = jaffarCommon::json::getNumber<size_t>(entry, "Size");
+      region.ptr = nullptr;
+      if (region.area != "RAM" && region.area != "VRAM") JAFFAR_THROW_LOGIC("Unrecognized hash region area: '%s'. Possible values: 'RAM', 'VRAM'\n", region.area.c_str());
+      _hashRegions.push_back(region);
+    }
+
+    // Parsing core options (libretro variables), e.g., { "ppsspp_cpu_core": "Interpreter" }. Options not given keep the core's defaults
+    const auto &coreOptions = jaffarCommon::json::getObject(config, "Core Options");
+    for (const auto& entry : coreOptions.items())
+    {
+      if (entry.value().is_string() == false) JAFFAR_THROW_LOGIC("Core option '%s' must be given as a string\n", entry.key().c_str());
+      _coreOptions[entry.key()] = entry.value().get<std::string>();
+    }
   }
 
   ~EmuInstance() = default;
  
   void advanceState(const jaffar::input_t &input)
   {
+    bindToCurrentThread();
     _currentInput = input;
-    _readInputs = false;
-     retro_run();
-     printf("Read Inputs: %s\n", _readInputs ? "True" : "False");
+    if (_avHashingEnabled == true) hashKernel::initialize(_audioHashState);
+    JAFFAR_TELEMETRY(telemetry::beginFrame());
+    retro_run();
+    JAFFAR_TELEMETRY(telemetry::endFrame());
+    if (_avHashingEnabled == true) _audioDigest = hashKernel::finalize(_audioHashState);
   }
 
+  // Per-frame video and audio digests, computed from the core's output as it is produced.
+  // They allow checking rendering determinism without storing the frames themselves.
+  void enableAVHashing() { _avHashingEnabled = true; }
+  void disableAVHashing() { _avHashingEnabled = false; }
+  inline jaffarCommon::hash::hash_t getVideoDigest() const { return _videoDigest; }
+  inline jaffarCommon::hash::hash_t getAudioDigest() const { return _audioDigest; }
+
+  // The state hash is a two-level tree over the page-sized chunks of the hash regions.
+  // In incremental mode, only the chunks lying on pages written since the last hash are rehashed.
   inline jaffarCommon::hash::hash_t getStateHash() const
   {
-    MetroHash128 hash;
-    
-    //  Getting RAM pointer and size
-    // hash.Update(_memoryAreas.wram, _memorySizes.wram);
-    // hash.Update(_memoryAreas.vram, _memorySizes.vram);
+    if (_incrementalHashingEnabled == false) return getFullStateHash();
+
+    // Collecting dirty pages and rehashing the chunks on them
+    _dirtyPageTracker.update();
+    for (size_t i = 0; i < _hashChunks.size(); i++)
+    {
+      const auto& chunk = _hashChunks[i];
+      if (_dirtyPageTracker.getDirtyPages(_hashConsumerId, chunk.rangeId)[chunk.pageId] == 0) continue;
+      _chunkHashes[i] = hashKernel::hash(chunk.ptr, chunk.size, i).first;
+      _dirtyGroups[i / _HASH_TREE_GROUP_SIZE] = 1;
+    }
+    _dirtyPageTracker.resetConsumer(_hashConsumerId);
 
-    jaffarCommon::hash::hash_t result;
-    hash.Finalize(reinterpret_cast<uint8_t *>(&result));
-    return result;
+    return combineChunkHashes();
+  }
+
+  // Rehashes every chunk, regardless of the incremental hashing mode
+  inline jaffarCommon::hash::hash_t getFullStateHash() const
+  {
+    for (size_t i = 0; i < _hashChunks.size(); i++) _chunkHashes[i] = hashKernel::hash(_hashChunks[i].ptr, _hashChunks[i].size, i).first;
+    std::fill(_dirtyGroups.begin(), _dirtyGroups.end(), 1);
+
+    return combineChunkHashes();
+  }
+
+  // Enables incremental state restore, if dirty page tracking is supported by the system.
+  // The last serialized state becomes the reference: deserializing it again only copies back the guest memory
+  // pages written since it was taken, plus the (small) rest of the system state. Any other state is fully loaded.
+  // Every state serialized from then on ends with a token, unique to the serialization that produced it, which tells
+  // the reference state apart from any other one later copied into its buffer. This grows the state size.
+  bool enableIncrementalRestore()
+  {
+    if (_dirtyPageTracker.isSupported() == false && _dirtyPageTracker.initialize() == false) return false;
+
+    // Memory areas need to start at page boundaries for pages to be copied back directly
+    if (_dirtyPageTracker.getRangeStart(_ramRangeId) != _memoryAreas.wram) return false;
+    if (_dirtyPageTracker.getRangeStart(_vramRangeId) != _memoryAreas.vram) return false;
+
+    // Allocating reference memory copies
+    _referenceRam.resize(_memorySizes.wram);
+    _referenceVram.resize(_memorySizes.vram);
+    _referenceScratchpad.resize(_memorySizes.scratchpad);
+
+    // Tokens start from a random value, so that states saved by other instances never match this one's
+    std::random_device randomDevice;
+    _referenceStateToken = ((uint64_t)randomDevice() << 32) | randomDevice();
+
+    _restoreConsumerId = _dirtyPageTracker.addConsumer();
+    _incrementalRestoreEnabled = true;
+    updateStateSize();
+    return true;
+  }
+
+  // Enables incremental hashing, if dirty page tracking is supported by the system
+  bool enableIncrementalHashing()
+  {
+    if (_dirtyPageTracker.isSupported() == false && _dirtyPageTracker.initialize() == false) return false;
+
+    _hashConsumerId = _dirtyPageTracker.addConsumer();
+    _incrementalHashingEnabled = true;
+    return true;
   }
 
   bool initialize()
   {
-    _instance = this;
+    bindToCurrentThread();
     retro_set_environment(retro_environment_callback);
     retro_set_input_poll(retro_input_poll_callback);
     retro_set_audio_sample_batch(retro_audio_sample_batch_callback);
@@ -179,11 +329,8 @@ class EmuInstance
       if (status == false) { fprintf(stderr, "Could not open compatibility atlas font metadata file: %s\n", _atlasFontMetadataFilePath.c_str()); return false; }
     }
 
-    // Reading rom file
-    {
-      auto status = jaffarCommon::file::loadStringFromFile(_gameData, _romFilePath);
-      if (status == false) { fprintf(stderr, "Could not open rom file: %s\n", _romFilePath.c_str()); return false; }
-    }
+    // Mapping rom file
+    if (openRom() == false) { fprintf(stderr, "Could not open rom file: %s\n", _romFilePath.c_str()); return false; }
 
     // Normal way to initialize
     retro_init();
@@ -195,19 +342,45 @@ class EmuInstance
     // Advancing until gpu is initialized -- this is necessary for proper savestates
     while (!gpu) retro_run();
 
+    // Getting memory areas. These are only allocated once the core has booted
+    _memoryAreas.wram = (uint8_t*) retro_get_memory_data(RETRO_MEMORY_SYSTEM_RAM);
+    _memorySizes.wram = retro_get_memory_size(RETRO_MEMORY_SYSTEM_RAM);
+    _memoryAreas.vram = Memory::GetPointerWriteUnchecked(PSP_GetVidMemBase());
+    _memorySizes.vram = PSP_GetVidMemEnd() - PSP_GetVidMemBase();
+    _memoryAreas.scratchpad = Memory::GetPointerWriteUnchecked(PSP_GetScratchpadMemoryBase());
+    _memorySizes.scratchpad = PSP_GetScratchpadMemoryEnd() - PSP_GetScratchpadMemoryBase();
+
+    // Registering memory areas for dirty page tracking, including every other view the core maps them through (as listed
+    // in MemMap's view table). Soft-dirty bits are kept per mapping, so a write through a view left out would go unnoticed
+    _ramRangeId = _dirtyPageTracker.addRange(_memoryAreas.wram, _memorySizes.wram, getMemoryViews(0x08000000, { 0x08000000 }));
+    _vramRangeId = _dirtyPageTracker.addRange(_memoryAreas.vram, _memorySizes.vram, getMemoryViews(0x04000000, { 0x04000000, 0x04200000, 0x04400000, 0x04600000 }));
+
+    // Resolving hash regions against the memory areas
+    initializeHashRegions();
+
+    // The video buffer holds a native resolution frame, so its address and size stay fixed for consumers
+    _videoBufferSize = VIDEO_HORIZONTAL_PIXELS * VIDEO_VERTICAL_PIXELS * sizeof(uint32_t);
+    _videoBuffer = (uint32_t*) calloc (1, _videoBufferSize);
+
     _audioBuffer = (uint16_t*) malloc (sizeof(uint16_t) * _AUDIO_MAX_SAMPLE_COUNT);
 
     // Getting state size
-    _stateSize = retro_serialize_size();
+    updateStateSize();
 
     return true;
   }
 
   void finalize()
   {
+    bindToCurrentThread();
     retro_unload_game();
   }
 
+  // Threads do not survive fork(), so the core's worker pool (used, e.g., by the software renderer) has to be stopped
+  // before forking an initialized instance, and started again in the child that goes on running it
+  void suspendWorkerThreads() { g_threadManager.Teardown(); }
+  void resumeWorkerThreads() { g_threadManager.Init(cpu_info.num_cores, cpu_info.logical_cpu_count); }
+
   void initializeVideoOutput()
   {
     SDL_Init(SDL_INIT_VIDEO);
@@ -235,6 +408,13 @@ class EmuInstance
   }
 
   void updateRenderer()
+  {
+    updateVideoBuffer();
+    updateRenderer((const uint8_t*)_videoBuffer);
+  }
+
+  // Displays a frame from an external buffer (of getVideoBufferSize() bytes), leaving the emulator's own video buffer untouched
+  void updateRenderer(const uint8_t* frame)
   {
     void *pixels = nullptr;
     int pitch = 0;
@@ -244,7 +424,7 @@ class EmuInstance
 
     if (SDL_LockTexture(_texture, nullptr, &pixels, &pitch) < 0) return;
 
-    memcpy(pixels, _videoBuffer, sizeof(uint32_t) * VIDEO_VERTICAL_PIXELS * VIDEO_HORIZONTAL_PIXELS);
+    memcpy(pixels, frame, _videoBufferSize);
     SDL_UnlockTexture(_texture);
     SDL_RenderClear(_renderer);
     SDL_RenderCopy(_renderer, _texture, &srcRect, &destRect);
@@ -253,37 +433,89 @@ class EmuInstance
 
   void enableStateBlock(const std::string& block) 
   {
-    // enableStateBlockImpl(block);
+    _enabledStateBlocks |= 1u << coreState::getBlock(block);
+    updateStateSize();
   }
 
   void disableStateBlock(const std::string& block)
   {
-    //  disableStateBlockImpl(block);
+    _enabledStateBlocks &= ~(1u << coreState::getBlock(block));
+    updateStateSize();
   }
 
-  inline size_t getStateSize() const 
-  {
-    return 0;
-    // return 134217728; // 128MB ought to be enough for anybody.
-    // return _stateSize; 
-  }
+  // A lite state contains only the enabled state blocks, and is serialized by us instead of the core
+  inline bool isLiteState() const { return _enabledStateBlocks != coreState::allBlocks; }
+
+  inline size_t getStateSize() const { return _stateSize; }
 
   inline jaffar::InputParser *getInputParser() const { return _inputParser.get(); }
   
   void serializeState(jaffarCommon::serializer::Base& s) const
   {
-    // retro_serialize(s.getOutputDataBuffer(), _stateSize);
-    // s.push(nullptr, _stateSize);
+    bindToCurrentThread();
+
+    // The core writes its state directly into the serializer's buffer, at its current position.
+    // If no buffer is provided, we are only measuring the state size
+    auto outputDataBuffer = s.getOutputDataBuffer();
+    if (outputDataBuffer != nullptr)
+    {
+      auto statePtr = &outputDataBuffer[s.getOutputSize()];
+      const auto coreStateSize = getCoreStateSize();
+      auto status = isLiteState() ? coreState::save(statePtr, coreStateSize, _enabledStateBlocks) : retro_serialize(statePtr, coreStateSize);
+      if (status == false) JAFFAR_THROW_RUNTIME("Could not serialize emulator state\n");
+
+      // Keeping this state as reference for incremental restores
+      if (_incrementalRestoreEnabled == true) updateReferenceState(statePtr);
+    }
+
+    // Advancing serializer position without copying anything
+    s.pushContiguous(nullptr, _stateSize);
   }
 
   void deserializeState(jaffarCommon::deserializer::Base& d) 
   {
-    // retro_unserialize(d.getInputDataBuffer(), _stateSize);
-    // d.pop(nullptr, _stateSize);
+    bindToCurrentThread();
+    auto statePtr = &d.getInputDataBuffer()[d.getInputSize()];
+
+    // If this is the reference state, try restoring only what changed since it was taken
+    bool isRestored = false;
+    if (_incrementalRestoreEnabled == true && isReferenceState(statePtr)) isRestored = restoreReferenceState();
+
+    // Otherwise, the core reads its state directly from the deserializer's buffer, at its current position
+    if (isRestored == false)
+    {
+      const auto coreStateSize = getCoreStateSize();
+      auto status = isLiteState() ? coreState::load((uint8_t*)statePtr, coreStateSize, _enabledStateBlocks) : retro_unserialize(statePtr, coreStateSize);
+      if (status == false) JAFFAR_THROW_RUNTIME("Could not deserialize emulator state\n");
+
+      // Guest memory no longer matches the reference copies
+      if (_incrementalRestoreEnabled == true) _dirtyPageTracker.invalidateConsumer(_restoreConsumerId);
+    }
+
+    // Advancing deserializer position without copying anything
+    d.popContiguous(nullptr, _stateSize);
   }
 
+  // SHA1 of the rom image, mapping it if it was not yet
+  std::string getRomSHA1()
+  {
+    if (openRom() == false) JAFFAR_THROW_LOGIC("Could not open rom file: %s\n", _romFilePath.c_str());
+    return _romImage.getSHA1String(_romHashCacheDirectory);
+  }
+
+  // Sets a core option, overriding the script's. It only takes effect if set before initializing
+  void setCoreOption(const std::string &key, const std::string &value) { _coreOptions[key] = value; }
+  const std::map<std::string, std::string> &getCoreOptions() const { return _coreOptions; }
+
+  // Directory where rom image hashes are kept across runs. Empty (the default) disables caching them
+  void setRomHashCacheDirectory(const std::string &directory) { _romHashCacheDirectory = directory; }
+  bool isRomSHA1Cached() const { return _romImage.isSHA1Cached(); }
+
+  // Format of the rom image: 'ISO', 'CSO' or 'CHD'
+  std::string getRomFormat() const { return _discImage != nullptr ? _discImage->getFormat() : "Unknown"; }
+
   size_t getVideoBufferSize() const { return _videoBufferSize; }
-  uint8_t* getVideoBufferPtr() const { return (uint8_t*)_videoBuffer; }
+  uint8_t* getVideoBufferPtr() const { updateVideoBuffer(); return (uint8_t*)_videoBuffer; }
 
   MemoryAreas getMemoryAreas() const { return _memoryAreas; }
   MemorySizes getMemorySizes() const { return _memorySizes; }
@@ -293,30 +525,222 @@ class EmuInstance
 
   private:
 
-  static __INLINE__ void RETRO_CALLCONV retro_video_refresh_callback(const void *data, unsigned width, unsigned height, size_t pitch)
+  // The core's callbacks reach this instance through a thread-local pointer. It has to be set on whichever thread is
+  // driving the core at the time, e.g., the player's background step generator, and not only where it was initialized
+  void bindToCurrentThread() const { _instance = const_cast<EmuInstance*>(this); }
+
+  bool openRom()
   {
-    auto curVideoBufferSize = _instance->_videoBufferSize;
-    _instance->_videoBufferSize = VIDEO_HORIZONTAL_PIXELS * VIDEO_VERTICAL_PIXELS * sizeof(uint32_t);
-    if (curVideoBufferSize != _instance->_videoBufferSize) _instance->_videoBuffer = (uint32_t*) realloc (_instance->_videoBuffer, _instance->_videoBufferSize);
+    if (_romImage.isOpen() && _romImage.getFilePath() == _romFilePath) return true;
+    if (_romImage.open(_romFilePath) == false) return false;
+
+    // Raw, CSO or CHD image, depending on its contents
+    _discImage = DiscImage::open(_romImage);
+    return _discImage != nullptr;
+  }
+
+  // Gets the views of a memory area other than its primary one: each of its cached mirrors plus their uncached
+  // counterparts, 0x40000000 above them
+  static std::vector<const uint8_t*> getMemoryViews(const uint32_t primaryAddress, const std::vector<uint32_t> &cachedMirrors)
+  {
+    std::vector<const uint8_t*> views;
+    for (const auto mirror : cachedMirrors)
+    {
+      if (mirror != primaryAddress) views.push_back(Memory::base + mirror);
+      views.push_back(Memory::base + (mirror | 0x40000000));
+    }
+    return views;
+  }
+
+  // Copies the last frame produced by the core into the video buffer, if it has not been copied yet.
+  // Frames larger than the native resolution are cropped.
+  void updateVideoBuffer() const
+  {
+    if (_isVideoFramePending == false) return;
+    _isVideoFramePending = false;
+
+    const size_t width = std::min(_videoFrameWidth, (size_t)VIDEO_HORIZONTAL_PIXELS);
+    const size_t height = std::min(_videoFrameHeight, (size_t)VIDEO_VERTICAL_PIXELS);
+    const size_t rowSize = width * sizeof(uint32_t);
+    const size_t bufferPitch = VIDEO_HORIZONTAL_PIXELS * sizeof(uint32_t);
+
+    // Contiguous frames of native width are copied at once
+    if (_videoFramePitch == bufferPitch && rowSize == bufferPitch) { memcpy(_videoBuffer, _videoFramePtr, height * bufferPitch); return; }
 
-    printf("Video %p, w: %u, h: %u, p: %lu\n", data, width, height, pitch);
-    size_t checksum = 0;
-    for (size_t i = 0; i < height; i++)
-     for (size_t j = 0; j < width; j++)
-     checksum += ((uint32_t*)data)[i*width + j];
-    printf("Video Checksum: 0x%lX\n", checksum);
-    
     for (size_t i = 0; i < height; i++)
-      memcpy(&_instance->_videoBuffer[i * width], &((uint8_t*)data)[i*pitch], sizeof(uint32_t) * width);
+      memcpy(&((uint8_t*)_videoBuffer)[i * bufferPitch], &_videoFramePtr[i * _videoFramePitch], rowSize);
+  }
+
+  void initializeHashRegions()
+  {
+    // If no regions were requested, hash all of RAM and VRAM
+    if (_hashRegions.empty())
+    {
+      _hashRegions.push_back(hashRegion_t{ "RAM", 0, _memorySizes.wram, nullptr });
+      _hashRegions.push_back(hashRegion_t{ "VRAM", 0, _memorySizes.vram, nullptr });
+    }
+
+    for (auto& region : _hashRegions)
+    {
+      auto areaPtr = region.area == "RAM" ? _memoryAreas.wram : _memoryAreas.vram;
+      auto areaSize = region.area == "RAM" ? _memorySizes.wram : _memorySizes.vram;
+      if (region.offset + region.size > areaSize) JAFFAR_THROW_LOGIC("Hash region [0x%lX, 0x%lX) exceeds the size of %s (0x%lX)\n", region.offset, region.offset + region.size, region.area.c_str(), areaSize);
+      region.ptr = &areaPtr[region.offset];
+    }
+
+    // Splitting hash regions into chunks that do not cross page boundaries
+    const size_t pageSize = _dirtyPageTracker.getPageSize();
+    for (const auto& region : _hashRegions)
+    {
+      const auto rangeId = region.area == "RAM" ? _ramRangeId : _vramRangeId;
+      const auto rangeStart = _dirtyPageTracker.getRangeStart(rangeId);
+      const uint8_t* regionEnd = region.ptr + region.size;
+      for (const uint8_t* ptr = region.ptr; ptr < regionEnd;)
+      {
+        const size_t pageId = (ptr - rangeStart) / pageSize;
+        const uint8_t* pageEnd = rangeStart + (pageId + 1) * pageSize;
+        const uint8_t* chunkEnd = std::min(pageEnd, regionEnd);
+        _hashChunks.push_back(hashChunk_t{ ptr, (size_t)(chunkEnd - ptr), rangeId, pageId });
+        ptr = chunkEnd;
+      }
+    }
+
+    _chunkHashes.resize(_hashChunks.size());
+    _groupHashes.resize((_hashChunks.size() + _HASH_TREE_GROUP_SIZE - 1) / _HASH_TREE_GROUP_SIZE);
+    _dirtyGroups.resize(_groupHashes.size(), 1);
+  }
+
+  void updateStateSize()
+  {
+    // State size can only be determined once the core has booted
+    if (gpu == nullptr) return;
+
+    // The full state size is an expensive call (it performs a full measuring pass over the state), so we cache it here.
+    // The core rounds it up to the next 8MB boundary, so there is enough room for the state to grow during emulation
+    if (isLiteState() == false) _stateSize = retro_serialize_size();
+
+    // For lite states, we measure only the enabled blocks
+    else
+    {
+      const size_t liteStateSize = coreState::measure(_enabledStateBlocks);
+      _stateSize = (liteStateSize + _LITE_STATE_SIZE_GRANULARITY) & ~((size_t)_LITE_STATE_SIZE_GRANULARITY - 1);
+    }
+
+    // Making room for the reference state token
+    if (_incrementalRestoreEnabled == true) _stateSize += _REFERENCE_STATE_TOKEN_SIZE;
+  }
+
+  // Size of the state written by the core, without the reference state token
+  inline size_t getCoreStateSize() const { return _incrementalRestoreEnabled == true ? _stateSize - _REFERENCE_STATE_TOKEN_SIZE : _stateSize; }
+
+  void updateReferenceState(uint8_t* statePtr) const
+  {
+    // Bringing the reference memory copies up to date with the pages written since the last update
+    _dirtyPageTracker.update();
+    coreState::withoutReplacements([&]() { coreState::withoutEmuHacks([&]()
+    {
+      if (coreState::isBlockEnabled(_enabledStateBlocks, coreState::ram)) copyDirtyPages(_ramRangeId, _memoryAreas.wram, _referenceRam.data(), _memorySizes.wram, true);
+      if (coreState::isBlockEnabled(_enabledStateBlocks, coreState::vram)) copyDirtyPages(_vramRangeId, _memoryAreas.vram, _referenceVram.data(), _memorySizes.vram, true);
+      if (coreState::isBlockEnabled(_enabledStateBlocks, coreState::scratchpad)) memcpy(_referenceScratchpad.data(), _memoryAreas.scratchpad, _memorySizes.scratchpad);
+    }); });
+    _dirtyPageTracker.resetConsumer(_restoreConsumerId);
+
+    // Saving the rest of the enabled blocks
+    const auto systemBlocks = _enabledStateBlocks & coreState::systemBlocks;
+    _referenceSystemState.resize(coreState::measure(systemBlocks));
+    if (coreState::save(_referenceSystemState.data(), _referenceSystemState.size(), systemBlocks) == false) JAFFAR_THROW_RUNTIME("Could not save reference system state\n");
+
+    // Marking the state with a new token. Only copies of this very state carry it
+    _referenceStateToken++;
+    memcpy(&statePtr[getCoreStateSize()], &_referenceStateToken, _REFERENCE_STATE_TOKEN_SIZE);
+    _referenceMemorySize = Memory::g_MemorySize;
+    _isReferenceStateValid = true;
+  }
+
+  bool isReferenceState(const uint8_t* statePtr) const
+  {
+    if (_isReferenceStateValid == false) return false;
+    if (Memory::g_MemorySize != _referenceMemorySize) return false;
+
+    // Any other state written into the buffer since, even one taken at the same frame, carries a different token
+    uint64_t token;
+    memcpy(&token, &statePtr[getCoreStateSize()], _REFERENCE_STATE_TOKEN_SIZE);
+    return token == _referenceStateToken;
+  }
+
+  bool restoreReferenceState()
+  {
+    // Discarding compiled code, as the reference copies of guest memory are free of JIT emulation hacks
+    coreState::clearJitCache();
+
+    // Copying back the pages written since the reference was taken. The reference copies hold the original instructions
+    // where the HLE replacements go, so these are taken out first and put back over the restored memory, as the core does
+    _dirtyPageTracker.update();
+    coreState::withoutReplacements([&]()
+    {
+      if (coreState::isBlockEnabled(_enabledStateBlocks, coreState::ram)) copyDirtyPages(_ramRangeId, _memoryAreas.wram, _referenceRam.data(), _memorySizes.wram, false);
+      if (coreState::isBlockEnabled(_enabledStateBlocks, coreState::vram)) copyDirtyPages(_vramRangeId, _memoryAreas.vram, _referenceVram.data(), _memorySizes.vram, false);
+      if (coreState::isBlockEnabled(_enabledStateBlocks, coreState::scratchpad)) memcpy(_memoryAreas.scratchpad, _referenceScratchpad.data(), _memorySizes.scratchpad);
+    });
+    _dirtyPageTracker.resetConsumer(_restoreConsumerId);
+
+    // Loading the rest of the enabled blocks
+    return coreState::load(_referenceSystemState.data(), _referenceSystemState.size(), _enabledStateBlocks & coreState::systemBlocks);
+  }
+
+  void copyDirtyPages(const size_t rangeId, uint8_t* area, uint8_t* reference, const size_t areaSize, const bool toReference) const
+  {
+    const size_t pageSize = _dirtyPageTracker.getPageSize();
+    const auto& dirtyPages = _dirtyPageTracker.getDirtyPages(_restoreConsumerId, rangeId);
+    for (size_t i = 0; i < dirtyPages.size(); i++) if (dirtyPages[i] == 1)
+    {
+      const size_t offset = i * pageSize;
+      const size_t size = std::min(pageSize, areaSize - offset);
+      if (toReference == true) memcpy(&reference[offset], &area[offset], size);
+      else memcpy(&area[offset], &reference[offset], size);
+    }
+  }
+
+  inline jaffarCommon::hash::hash_t combineChunkHashes() const
+  {
+    // Updating the intermediate nodes whose chunks changed
+    for (size_t i = 0; i < _groupHashes.size(); i++) if (_dirtyGroups[i] == 1)
+    {
+      const size_t firstChunk = i * _HASH_TREE_GROUP_SIZE;
+      const size_t chunkCount = std::min((size_t)_HASH_TREE_GROUP_SIZE, _chunkHashes.size() - firstChunk);
+      _groupHashes[i] = hashKernel::hash(&_chunkHashes[firstChunk], chunkCount * sizeof(uint64_t), i).first;
+      _dirtyGroups[i] = 0;
+    }
+
+    // Combining intermediate nodes into the root
+    return hashKernel::hash(_groupHashes.data(), _groupHashes.size() * sizeof(uint64_t));
+  }
+
+  static __INLINE__ void RETRO_CALLCONV retro_video_refresh_callback(const void *data, unsigned width, unsigned height, size_t pitch)
+  {
+    JAFFAR_TELEMETRY(telemetry::onVideo(data, width, height, pitch));
+
+    // A null frame means it is a duplicate of the previous one
+    if (data == nullptr) return;
+
+    if (_instance->_avHashingEnabled == true) _instance->_videoDigest = hashKernel::hashFrame(data, width, height, pitch);
+
+    // Only the frame's location and layout are kept here. The copy happens when a consumer asks for the pixels,
+    // relying on the core's software framebuffer staying valid until the next retro_run
+    _instance->_videoFramePtr = (const uint8_t*)data;
+    _instance->_videoFrameWidth = width;
+    _instance->_videoFrameHeight = height;
+    _instance->_videoFramePitch = pitch;
+    _instance->_isVideoFramePending = true;
+
+    // When rendering, the frame is displayed anyway, so it is copied right away
+    if (_instance->_renderingEnabled == true) _instance->updateVideoBuffer();
   }
 
   static __INLINE__ size_t RETRO_CALLCONV retro_audio_sample_batch_callback(const int16_t *data, size_t frames)
   {
-    printf("Audio frames: %lu\n", frames);
-    size_t checksum = 0;
-    for (size_t i = 0; i < frames; i++)
-     checksum += ((int16_t*)data)[i];
-    printf("Audio Checksum: 0x%lX\n", checksum);
+    JAFFAR_TELEMETRY(telemetry::onAudio(data, frames));
+    if (_instance->_avHashingEnabled == true) hashKernel::updateAudio(_instance->_audioHashState, data, frames);
     // memcpy(_instance->_audioBuffer, data, sizeof(int16_t) * frames);
     // _instance->_audioSamples = frames;
     return frames;
@@ -324,7 +748,7 @@ class EmuInstance
 
   static __INLINE__ void RETRO_CALLCONV retro_input_poll_callback()
   {
-    // printf("Libretro Input Poll Callback Called:\n");
+    JAFFAR_TELEMETRY(telemetry::onInputPoll());
   }
 
   static __INLINE__ bool RETRO_CALLCONV retro_environment_callback(unsigned cmd, void *data)
@@ -359,47 +783,28 @@ class EmuInstance
     return false;
   }
 
+  // Options not set are left null, so that the core falls back to its defaults
   __INLINE__ void configHandler(struct retro_variable *var)
   {
-    var->value = nullptr;
-    //printf("Variable Name: %s / Value: %s\n", var->key, var->value);
-    std::string key(var->key);
+    const auto it = _coreOptions.find(var->key);
+    var->value = it != _coreOptions.end() ? it->second.c_str() : nullptr;
   }
 
   static __INLINE__ int16_t RETRO_CALLCONV retro_input_state_callback(unsigned port, unsigned device, unsigned index, unsigned id)
   {
-    if (device == RETRO_DEVICE_JOYPAD) switch (id)
-    {
-      case RETRO_DEVICE_ID_JOYPAD_UP: return _instance->_currentInput.up ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_DOWN: return _instance->_currentInput.down ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_LEFT: return _instance->_currentInput.left ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_RIGHT: return _instance->_currentInput.right ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_L: return _instance->_currentInput.ltrigger ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_R: return _instance->_currentInput.rtrigger ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_SELECT: return _instance->_currentInput.select ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_START: return _instance->_currentInput.start ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_X: return _instance->_currentInput.triangle ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_Y: return _instance->_currentInput.square ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_B: return _instance->_currentInput.cross ? 1 : 0;
-      case RETRO_DEVICE_ID_JOYPAD_A: return _instance->_currentInput.circle ? 1 : 0;
-      default: return 0;
-    }
+    const auto &input = _instance->_currentInput;
 
-    if (device == RETRO_DEVICE_ANALOG) switch (id)
+    if (device == RETRO_DEVICE_JOYPAD)
     {
-        case RETRO_DEVICE_ID_ANALOG_X:
-          if (index == RETRO_DEVICE_INDEX_ANALOG_LEFT) return _instance->_currentInput.leftAnalogX; 
-          if (index == RETRO_DEVICE_INDEX_ANALOG_RIGHT) return _instance->_currentInput.rightAnalogX; 
-          return 0;
-  
-        case RETRO_DEVICE_ID_ANALOG_Y:
-          if (index == RETRO_DEVICE_INDEX_ANALOG_LEFT) return _instance->_currentInput.leftAnalogY; 
-          if (index == RETRO_DEVICE_INDEX_ANALOG_RIGHT) return _instance->_currentInput.rightAnalogY; 
-          return 0;
+      if (id < _joypadIdToMask.size()) return (input.buttons & _joypadIdToMask[id]) != 0;
 
-        default: return 0;
+      // Bitmask queries get all joypad buttons at once, as their bits follow libretro's ids
+      if (id == RETRO_DEVICE_ID_JOYPAD_MASK) return input.buttons & _joypadButtonsMask;
+      return 0;
     }
-  
+
+    if (device == RETRO_DEVICE_ANALOG && index <= RETRO_DEVICE_INDEX_ANALOG_RIGHT && id <= RETRO_DEVICE_ID_ANALOG_Y) return unpackAnalog(input.analogs[index * 2 + id]);
+
     return 0;
   }
 
@@ -407,7 +812,7 @@ class EmuInstance
   {
     va_list ap;
     va_start(ap, format);
-    printf(format, ap);
+    telemetry::log(level, format, ap);
     va_end(ap);
   }
 
@@ -416,28 +821,74 @@ class EmuInstance
   // State size
   size_t _stateSize = 0;
 
+  // State blocks to include in serialization
+  coreState::blockMask_t _enabledStateBlocks = coreState::allBlocks;
+
   // Holds the current input for when the input state callback is called
   jaffar::input_t _currentInput;
 
   MemoryAreas _memoryAreas;
   MemorySizes _memorySizes;
 
-  // Dummy storage for state load/save
-  uint8_t* _dummyStateData;
+  // Memory regions included in the state hash
+  std::vector<hashRegion_t> _hashRegions;
+
+  // Hash tree: page-sized chunks, their cached hashes and the intermediate nodes
+  std::vector<hashChunk_t> _hashChunks;
+  mutable std::vector<uint64_t> _chunkHashes;
+  mutable std::vector<uint64_t> _groupHashes;
+  mutable std::vector<uint8_t> _dirtyGroups;
+
+  // Dirty page tracking over RAM and VRAM
+  mutable DirtyPageTracker _dirtyPageTracker;
+  size_t _ramRangeId;
+  size_t _vramRangeId;
+  size_t _hashConsumerId;
+  bool _incrementalHashingEnabled = false;
+
+  // Reference state for incremental restores: copies of guest memory and the rest of the system state
+  size_t _restoreConsumerId;
+  bool _incrementalRestoreEnabled = false;
+  mutable std::vector<uint8_t> _referenceRam;
+  mutable std::vector<uint8_t> _referenceVram;
+  mutable std::vector<uint8_t> _referenceScratchpad;
+  mutable std::vector<uint8_t> _referenceSystemState;
+  mutable uint64_t _referenceStateToken = 0;
+  mutable size_t _referenceMemorySize = 0;
+  mutable bool _isReferenceStateValid = false;
 
   // Input parser instance
   std::unique_ptr<jaffar::InputParser> _inputParser;
 
+  // Core options requested, by libretro variable name
+  std::map<std::string, std::string> _coreOptions;
+
+  // Rom image hash cache location, if enabled
+  std::string _romHashCacheDirectory;
+
   // Rendering stuff
   SDL_Window* _renderWindow;
   SDL_Renderer* _renderer;
   SDL_Texture* _texture;
   uint32_t* _videoBuffer = nullptr;
-  size_t _videoBufferSize;
-  size_t _videoPitch;
+  size_t _videoBufferSize = 0;
+
+  // Last frame produced by the core, not yet copied into the video buffer
+  const uint8_t* _videoFramePtr = nullptr;
+  size_t _videoFrameWidth = 0;
+  size_t _videoFrameHeight = 0;
+  size_t _videoFramePitch = 0;
+  mutable bool _isVideoFramePending = false;
 
   bool _renderingEnabled = false;
   uint16_t* _audioBuffer;
+
+  // Per-frame output digests
+  bool _avHashingEnabled = false;
+  jaffarCommon::hash::hash_t _videoDigest;
+  jaffarCommon::hash::hash_t _audioDigest;
+  hashKernel::state_t _audioHashState;
+
   size_t _audioSamples = 0;
 };
 
@@ -0,0 +1,241 @@
+#pragma once
+
+// Vectorized hashing kernel for emulator memory, video frames and audio batches
+// It processes data in 32-byte stripes over four 64-bit accumulator lanes. The AVX2, SSE4 and
+// scalar paths produce exactly the same result, the widest supported one being selected at runtime.
+
+#include <cstdint>
+#include <cstring>
+#include <jaffarCommon/hash.hpp>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define _JAFFAR_HASH_KERNEL_X86
+  #include <immintrin.h>
+#endif
+
+namespace jaffar
+{
+
+namespace hashKernel
+{
+
+// Number of bytes consumed per stripe (four 64-bit lanes)
+#define _HASH_KERNEL_STRIPE_SIZE 32
+
+// Number of stripes between accumulator scrambles
+#define _HASH_KERNEL_STRIPES_PER_BLOCK 32
+
+// Per-lane secret keys and multiplication primes
+alignas(32) static constexpr uint64_t _keys[4] = { 0xBE4BA423396CFEB8ull, 0x1CAD21F72C81017Cull, 0xDB979083E96DD4DEull, 0x1F67B3B7A4A44072ull };
+static constexpr uint64_t _prime32 = 0x9E3779B1ull;
+static constexpr uint64_t _prime64a = 0x9E3779B185EBCA87ull;
+static constexpr uint64_t _prime64b = 0xC2B2AE3D27D4EB4Full;
+
+struct state_t
+{
+  alignas(32) uint64_t acc[4];
+  uint64_t length;
+};
+
+inline void initialize(state_t &state, const uint64_t seed = 0)
+{
+  for (size_t i = 0; i < 4; i++) state.acc[i] = _keys[i] ^ seed;
+  state.length = 0;
+}
+
+inline uint64_t avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ull;
+  h ^= h >> 32;
+  return h;
+}
+
+////////// Scalar path
+
+inline void accumulateStripeScalar(uint64_t *acc, const uint8_t *data)
+{
+  for (size_t i = 0; i < 4; i++)
+  {
+    uint64_t value;
+    memcpy(&value, &data[i * sizeof(uint64_t)], sizeof(uint64_t));
+    const uint64_t dataKey = value ^ _keys[i];
+    acc[i] += value + (dataKey & 0xFFFFFFFFull) * (dataKey >> 32);
+  }
+}
+
+inline void scrambleScalar(uint64_t *acc)
+{
+  for (size_t i = 0; i < 4; i++)
+  {
+    uint64_t a = acc[i];
+    a ^= a >> 47;
+    a ^= _keys[i];
+    acc[i] = a * _prime32;
+  }
+}
+
+inline void accumulateScalar(uint64_t *acc, const uint8_t *data, const size_t stripeCount)
+{
+  for (size_t i = 0; i < stripeCount; i++)
+  {
+    accumulateStripeScalar(acc, &data[i * _HASH_KERNEL_STRIPE_SIZE]);
+    if ((i + 1) % _HASH_KERNEL_STRIPES_PER_BLOCK == 0) scrambleScalar(acc);
+  }
+}
+
+////////// AVX2 path
+
+#ifdef _JAFFAR_HASH_KERNEL_X86
+
+__attribute__((target("avx2"))) inline void accumulateAVX2(uint64_t *acc, const uint8_t *data, const size_t stripeCount)
+{
+  const __m256i keys = _mm256_load_si256((const __m256i *)_keys);
+  const __m256i prime = _mm256_set1_epi32((int)_prime32);
+  __m256i a = _mm256_load_si256((const __m256i *)acc);
+
+  for (size_t i = 0; i < stripeCount; i++)
+  {
+    const __m256i value = _mm256_loadu_si256((const __m256i *)&data[i * _HASH_KERNEL_STRIPE_SIZE]);
+    const __m256i dataKey = _mm256_xor_si256(value, keys);
+    const __m256i dataKeyHi = _mm256_srli_epi64(dataKey, 32);
+    const __m256i product = _mm256_mul_epu32(dataKey, dataKeyHi);
+    a = _mm256_add_epi64(a, _mm256_add_epi64(value, product));
+
+    if ((i + 1) % _HASH_KERNEL_STRIPES_PER_BLOCK == 0)
+    {
+      a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+      a = _mm256_xor_si256(a, keys);
+      const __m256i lo = _mm256_mul_epu32(a, prime);
+      const __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+      a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+  }
+
+  _mm256_store_si256((__m256i *)acc, a);
+}
+
+inline bool isAVX2Supported()
+{
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+
+////////// SSE4 path
+
+// Processes two of the four lanes
+__attribute__((target("sse4.1"))) inline __m128i accumulateLanesSSE4(__m128i a, const __m128i value, const __m128i keys)
+{
+  const __m128i dataKey = _mm_xor_si128(value, keys);
+  const __m128i product = _mm_mul_epu32(dataKey, _mm_srli_epi64(dataKey, 32));
+  return _mm_add_epi64(a, _mm_add_epi64(value, product));
+}
+
+__attribute__((target("sse4.1"))) inline __m128i scrambleLanesSSE4(__m128i a, const __m128i keys, const __m128i prime)
+{
+  a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+  a = _mm_xor_si128(a, keys);
+  const __m128i lo = _mm_mul_epu32(a, prime);
+  const __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+  return _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+}
+
+__attribute__((target("sse4.1"))) inline void accumulateSSE4(uint64_t *acc, const uint8_t *data, const size_t stripeCount)
+{
+  const __m128i keysLo = _mm_load_si128((const __m128i *)&_keys[0]);
+  const __m128i keysHi = _mm_load_si128((const __m128i *)&_keys[2]);
+  const __m128i prime = _mm_set1_epi32((int)_prime32);
+  __m128i aLo = _mm_load_si128((const __m128i *)&acc[0]);
+  __m128i aHi = _mm_load_si128((const __m128i *)&acc[2]);
+
+  for (size_t i = 0; i < stripeCount; i++)
+  {
+    const uint8_t *stripe = &data[i * _HASH_KERNEL_STRIPE_SIZE];
+    aLo = accumulateLanesSSE4(aLo, _mm_loadu_si128((const __m128i *)&stripe[0]), keysLo);
+    aHi = accumulateLanesSSE4(aHi, _mm_loadu_si128((const __m128i *)&stripe[16]), keysHi);
+
+    if ((i + 1) % _HASH_KERNEL_STRIPES_PER_BLOCK == 0)
+    {
+      aLo = scrambleLanesSSE4(aLo, keysLo, prime);
+      aHi = scrambleLanesSSE4(aHi, keysHi, prime);
+    }
+  }
+
+  _mm_store_si128((__m128i *)&acc[0], aLo);
+  _mm_store_si128((__m128i *)&acc[2], aHi);
+}
+
+inline bool isSSE4Supported()
+{
+  static const bool supported = __builtin_cpu_supports("sse4.1");
+  return supported;
+}
+
+#endif // _JAFFAR_HASH_KERNEL_X86
+
+////////// Public interface
+
+// Hashes the contents of the given buffer into the running state. Trailing bytes that do not fill
+// a complete stripe are zero-padded, so consecutive updates are deterministic but not equivalent to
+// a single update over the concatenated buffers.
+inline void update(state_t &state, const void *data, const size_t size)
+{
+  const auto bytes = (const uint8_t *)data;
+  const size_t stripeCount = size / _HASH_KERNEL_STRIPE_SIZE;
+  const size_t tailSize = size % _HASH_KERNEL_STRIPE_SIZE;
+
+#ifdef _JAFFAR_HASH_KERNEL_X86
+  if (isAVX2Supported()) accumulateAVX2(state.acc, bytes, stripeCount);
+  else if (isSSE4Supported()) accumulateSSE4(state.acc, bytes, stripeCount);
+  else accumulateScalar(state.acc, bytes, stripeCount);
+#else
+  accumulateScalar(state.acc, bytes, stripeCount);
+#endif
+
+  if (tailSize > 0)
+  {
+    uint8_t tail[_HASH_KERNEL_STRIPE_SIZE] = {0};
+    memcpy(tail, &bytes[stripeCount * _HASH_KERNEL_STRIPE_SIZE], tailSize);
+    accumulateStripeScalar(state.acc, tail);
+  }
+
+  state.length += size;
+}
+
+inline jaffarCommon::hash::hash_t finalize(const state_t &state)
+{
+  uint64_t lo = state.length * _prime64a;
+  uint64_t hi = ~state.length * _prime64b;
+  for (size_t i = 0; i < 4; i++)
+  {
+    lo = avalanche(lo ^ (state.acc[i] * _prime64a));
+    hi = avalanche(hi + (state.acc[i] ^ _keys[3 - i]) * _prime64b);
+  }
+
+  return jaffarCommon::hash::hash_t(lo, hi);
+}
+
+inline jaffarCommon::hash::hash_t hash(const void *data, const size_t size, const uint64_t seed = 0)
+{
+  state_t state;
+  initialize(state, seed);
+  update(state, data, size);
+  return finalize(state);
+}
+
+// Digest of an XRGB8888 frame. Rows are hashed one by one, so the result does not depend on the pitch,
+// and the dimensions are part of the seed, so frames of different sizes do not collide trivially.
+inline jaffarCommon::hash::hash_t hashFrame(const void *data, const size_t width, const size_t height, const size_t pitch)
+{
+  state_t state;
+  initialize(state, ((uint64_t)width << 32) | (uint64_t)height);
+  for (size_t i = 0; i < height; i++) update(state, &((const uint8_t *)data)[i * pitch], width * sizeof(uint32_t));
+  return finalize(state);
+}
+
+// Adds a batch of interleaved stereo int16 audio frames to a running audio digest
+inline void updateAudio(state_t &state, const int16_t *data, const size_t frames) { update(state, data, frames * 2 * sizeof(int16_t)); }
+
+} // namespace hashKernel
+
+} // namespace jaffar
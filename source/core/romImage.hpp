@@ -0,0 +1,169 @@
+#pragma once
+
+// Read-only memory mapping of a ROM image
+// Sector reads are served straight from the mapping, so the image is never copied into process memory
+// and all processes running the same image share a single copy of it in the page cache.
+// Hashing a whole image takes seconds for large ones, so its SHA1 can be kept in a cache directory across runs,
+// keyed by the image file's identity: device, inode, size and modification/change times.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Common/Crypto/sha1.h>
+
+namespace jaffar
+{
+
+// Bytes passed to each SHA1 update, which takes an int length
+#define _ROM_IMAGE_SHA1_CHUNK_SIZE 0x4000000
+
+class RomImage
+{
+  public:
+
+  RomImage() = default;
+  RomImage(const RomImage &) = delete;
+  RomImage &operator=(const RomImage &) = delete;
+  ~RomImage() { close(); }
+
+  bool open(const std::string &filePath)
+  {
+    close();
+
+    int fd = ::open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) { ::close(fd); return false; }
+
+    // The mapping stays valid after closing the descriptor
+    auto data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) return false;
+
+    _data = (const uint8_t *)data;
+    _size = fileStat.st_size;
+    _filePath = filePath;
+    _device = fileStat.st_dev;
+    _inode = fileStat.st_ino;
+    _modificationTime = (int64_t)fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+    _changeTime = (int64_t)fileStat.st_ctim.tv_sec * 1000000000 + fileStat.st_ctim.tv_nsec;
+    return true;
+  }
+
+  void close()
+  {
+    if (_data != nullptr) munmap((void *)_data, _size);
+    _data = nullptr;
+    _size = 0;
+    _sha1 = "";
+    _isSHA1Cached = false;
+  }
+
+  bool isOpen() const { return _data != nullptr; }
+  const uint8_t *getData() const { return _data; }
+  size_t getSize() const { return _size; }
+  const std::string &getFilePath() const { return _filePath; }
+
+  // Copies up to 'size' bytes starting at 'offset', clamped to the end of the image. Returns the bytes copied
+  size_t read(void *buffer, const uint64_t offset, const size_t size) const
+  {
+    if (offset >= _size) return 0;
+    const size_t readSize = std::min((uint64_t)size, _size - offset);
+    memcpy(buffer, &_data[offset], readSize);
+    return readSize;
+  }
+
+  // Uppercase hexadecimal SHA1 of the image. It is computed only once, and not at all if found in the given cache directory
+  const std::string &getSHA1String(const std::string &cacheDirectory = "")
+  {
+    if (_sha1 != "" || _data == nullptr) return _sha1;
+    if (cacheDirectory != "" && loadCachedSHA1(cacheDirectory) == true) return _sha1;
+
+    // The whole image is read through once, front to back
+    madvise((void *)_data, _size, MADV_SEQUENTIAL);
+
+    sha1_context context;
+    sha1_starts(&context);
+    for (size_t offset = 0; offset < _size; offset += _ROM_IMAGE_SHA1_CHUNK_SIZE)
+      sha1_update(&context, &_data[offset], (int)std::min((size_t)_ROM_IMAGE_SHA1_CHUNK_SIZE, _size - offset));
+
+    unsigned char digest[20];
+    sha1_finish(&context, digest);
+
+    // Back to default read-ahead for sector reads
+    madvise((void *)_data, _size, MADV_NORMAL);
+
+    char digestString[41];
+    for (size_t i = 0; i < 20; i++) sprintf(&digestString[i * 2], "%02X", digest[i]);
+    _sha1 = digestString;
+
+    if (cacheDirectory != "") saveCachedSHA1(cacheDirectory);
+    return _sha1;
+  }
+
+  bool isSHA1Cached() const { return _isSHA1Cached; }
+
+  private:
+
+  std::string getCacheFilePath(const std::string &cacheDirectory) const
+  {
+    return cacheDirectory + "/rom_" + std::to_string(_device) + "_" + std::to_string(_inode) + ".sha1";
+  }
+
+  // Cache entries hold the image's size and times, followed by its hash. An entry for a file that changed is ignored
+  bool loadCachedSHA1(const std::string &cacheDirectory)
+  {
+    auto file = fopen(getCacheFilePath(cacheDirectory).c_str(), "r");
+    if (file == nullptr) return false;
+
+    unsigned long size;
+    long long modificationTime;
+    long long changeTime;
+    char sha1[41];
+    const auto fields = fscanf(file, "%lu %lld %lld %40s", &size, &modificationTime, &changeTime, sha1);
+    fclose(file);
+
+    if (fields != 4 || size != _size || modificationTime != _modificationTime || changeTime != _changeTime || strlen(sha1) != 40) return false;
+
+    _sha1 = sha1;
+    _isSHA1Cached = true;
+    return true;
+  }
+
+  // The entry is written to a temporary file and renamed into place, so that concurrent runs never read a partial one.
+  // Failing to write it only means hashing again next time
+  void saveCachedSHA1(const std::string &cacheDirectory) const
+  {
+    if (mkdir(cacheDirectory.c_str(), 0755) != 0 && errno != EEXIST) return;
+
+    const auto filePath = getCacheFilePath(cacheDirectory);
+    const auto temporaryFilePath = filePath + "." + std::to_string(getpid());
+    auto file = fopen(temporaryFilePath.c_str(), "w");
+    if (file == nullptr) return;
+
+    const bool status = fprintf(file, "%lu %lld %lld %s\n", (unsigned long)_size, (long long)_modificationTime, (long long)_changeTime, _sha1.c_str()) > 0;
+    if (fclose(file) != 0 || status == false || rename(temporaryFilePath.c_str(), filePath.c_str()) != 0) unlink(temporaryFilePath.c_str());
+  }
+
+  const uint8_t *_data = nullptr;
+  size_t _size = 0;
+  std::string _filePath;
+  std::string _sha1;
+  bool _isSHA1Cached = false;
+
+  // Identity of the image file, as a cache key
+  dev_t _device = 0;
+  ino_t _inode = 0;
+  int64_t _modificationTime = 0;
+  int64_t _changeTime = 0;
+};
+
+} // namespace jaffar
@@ -0,0 +1,153 @@
+#pragma once
+
+// Per-frame telemetry for the emulator instance
+// Counters are written into a preallocated ring buffer and dumped (as CSV or raw binary records) at the end.
+// Unless JAFFAR_ENABLE_TELEMETRY is defined (meson option 'enableTelemetry'), all JAFFAR_TELEMETRY(...)
+// statements compile to nothing, so the per-frame hot path carries no cost.
+// Core log messages always go through here, filtered by level.
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <libretro.h>
+#include "hashKernel.hpp"
+
+#ifdef JAFFAR_ENABLE_TELEMETRY
+  #define JAFFAR_TELEMETRY(statement) statement
+#else
+  #define JAFFAR_TELEMETRY(statement)
+#endif
+
+namespace jaffar
+{
+
+namespace telemetry
+{
+
+// Default number of frames kept in the ring buffer
+#define _TELEMETRY_DEFAULT_CAPACITY 65536
+
+struct frameRecord_t
+{
+  uint64_t frame;
+  uint32_t inputPolls;
+  uint32_t audioFrames;
+  uint16_t videoWidth;
+  uint16_t videoHeight;
+  uint32_t logMessages;
+  uint64_t videoChecksum;
+  uint64_t audioChecksum;
+};
+
+inline std::vector<frameRecord_t> _records;
+inline size_t _frameCount = 0;
+inline frameRecord_t _discardedRecord;
+inline frameRecord_t *_currentRecord = &_discardedRecord;
+inline bool _checksumsEnabled = false;
+inline retro_log_level _logLevel = RETRO_LOG_WARN;
+
+inline bool isEnabled()
+{
+#ifdef JAFFAR_ENABLE_TELEMETRY
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Preallocates the ring buffer. Only the last 'capacity' frames are kept
+inline void initialize(const size_t capacity = _TELEMETRY_DEFAULT_CAPACITY)
+{
+  _records.resize(capacity);
+  _frameCount = 0;
+  _currentRecord = &_discardedRecord;
+}
+
+inline void setChecksumsEnabled(const bool enabled) { _checksumsEnabled = enabled; }
+inline bool isChecksumsEnabled() { return _checksumsEnabled; }
+inline void setLogLevel(const retro_log_level level) { _logLevel = level; }
+
+inline void beginFrame()
+{
+  _currentRecord = _records.empty() ? &_discardedRecord : &_records[_frameCount % _records.size()];
+  *_currentRecord = frameRecord_t{};
+  _currentRecord->frame = _frameCount;
+}
+
+inline void endFrame()
+{
+  _frameCount++;
+  _currentRecord = &_discardedRecord;
+}
+
+inline void onInputPoll() { _currentRecord->inputPolls++; }
+
+inline void onAudio(const int16_t *data, const size_t frames)
+{
+  _currentRecord->audioFrames += frames;
+  if (_checksumsEnabled == false) return;
+
+  hashKernel::state_t hashState;
+  hashKernel::initialize(hashState, _currentRecord->audioChecksum);
+  hashKernel::updateAudio(hashState, data, frames);
+  _currentRecord->audioChecksum = hashKernel::finalize(hashState).first;
+}
+
+inline void onVideo(const void *data, const unsigned width, const unsigned height, const size_t pitch)
+{
+  _currentRecord->videoWidth = width;
+  _currentRecord->videoHeight = height;
+  if (_checksumsEnabled == false || data == nullptr) return;
+  _currentRecord->videoChecksum = hashKernel::hashFrame(data, width, height, pitch).first;
+}
+
+// Core log messages are printed to stderr if they are at or above the requested level
+inline void log(const retro_log_level level, const char *format, va_list ap)
+{
+  JAFFAR_TELEMETRY(_currentRecord->logMessages++);
+  if (level < _logLevel) return;
+  vfprintf(stderr, format, ap);
+}
+
+// Returns the recorded frames in chronological order
+inline std::vector<frameRecord_t> getRecords()
+{
+  std::vector<frameRecord_t> records;
+  if (_records.empty()) return records;
+  const size_t count = std::min(_frameCount, _records.size());
+  const size_t first = _frameCount - count;
+  for (size_t i = first; i < _frameCount; i++) records.push_back(_records[i % _records.size()]);
+  return records;
+}
+
+inline bool dumpCSV(const std::string &filePath)
+{
+  auto file = fopen(filePath.c_str(), "w");
+  if (file == nullptr) return false;
+
+  fprintf(file, "Frame,Input Polls,Audio Frames,Video Width,Video Height,Log Messages,Video Checksum,Audio Checksum\n");
+  for (const auto &r : getRecords())
+    fprintf(file, "%lu,%u,%u,%u,%u,%u,0x%016lX,0x%016lX\n", r.frame, r.inputPolls, r.audioFrames, r.videoWidth, r.videoHeight, r.logMessages, r.videoChecksum, r.audioChecksum);
+
+  fclose(file);
+  return true;
+}
+
+inline bool dumpBinary(const std::string &filePath)
+{
+  auto file = fopen(filePath.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  const auto records = getRecords();
+  const bool status = fwrite(records.data(), sizeof(frameRecord_t), records.size(), file) == records.size();
+
+  fclose(file);
+  return status;
+}
+
+} // namespace telemetry
+
+} // namespace jaffar
@@ -0,0 +1,119 @@
+#pragma once
+
+// Delta compression of consecutive buffers (e.g., emulator states)
+// A buffer is split into fixed-size chunks, and only the chunks that differ from the previous buffer are kept, XOR'ed
+// against it and compressed together as a single zstd frame. Applying a delta then only touches the changed chunks.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <zstd.h>
+#include <jaffarCommon/exceptions.hpp>
+
+namespace jaffar
+{
+
+#define _DELTA_CODEC_CHUNK_SIZE 4096
+#define _DELTA_CODEC_COMPRESSION_LEVEL 1
+
+struct delta_t
+{
+  // Indexes of the changed chunks, in increasing order
+  std::vector<uint32_t> chunks;
+
+  // Compressed XOR of the changed chunks, and its size once decompressed
+  std::vector<uint8_t> data;
+  size_t rawSize = 0;
+
+  size_t getStorageSize() const { return chunks.size() * sizeof(uint32_t) + data.size(); }
+};
+
+class DeltaCodec
+{
+  public:
+
+  DeltaCodec(const size_t bufferSize) :
+   _bufferSize(bufferSize),
+   _chunkCount((bufferSize + _DELTA_CODEC_CHUNK_SIZE - 1) / _DELTA_CODEC_CHUNK_SIZE)
+  {
+    _compressionContext = ZSTD_createCCtx();
+    _decompressionContext = ZSTD_createDCtx();
+    if (_compressionContext == nullptr || _decompressionContext == nullptr) JAFFAR_THROW_RUNTIME("Could not create zstd contexts\n");
+
+    _staging.resize(_chunkCount * _DELTA_CODEC_CHUNK_SIZE);
+    _compressed.resize(ZSTD_compressBound(_staging.size()));
+  }
+
+  DeltaCodec(const DeltaCodec &) = delete;
+  DeltaCodec &operator=(const DeltaCodec &) = delete;
+
+  ~DeltaCodec()
+  {
+    ZSTD_freeCCtx(_compressionContext);
+    ZSTD_freeDCtx(_decompressionContext);
+  }
+
+  // Encodes the difference between two buffers of the codec's size
+  void encode(delta_t &delta, const uint8_t *current, const uint8_t *previous)
+  {
+    delta.chunks.clear();
+    size_t stagedSize = 0;
+
+    for (size_t i = 0; i < _chunkCount; i++)
+    {
+      const size_t offset = i * _DELTA_CODEC_CHUNK_SIZE;
+      const size_t size = std::min((size_t)_DELTA_CODEC_CHUNK_SIZE, _bufferSize - offset);
+      if (memcmp(&current[offset], &previous[offset], size) == 0) continue;
+
+      delta.chunks.push_back(i);
+      for (size_t j = 0; j < size; j++) _staging[stagedSize + j] = current[offset + j] ^ previous[offset + j];
+      stagedSize += size;
+    }
+    delta.chunks.shrink_to_fit();
+
+    // Compressing the changed chunks together
+    delta.rawSize = stagedSize;
+    delta.data.clear();
+    if (stagedSize == 0) { delta.data.shrink_to_fit(); return; }
+
+    const auto compressedSize = ZSTD_compressCCtx(_compressionContext, _compressed.data(), _compressed.size(), _staging.data(), stagedSize, _DELTA_CODEC_COMPRESSION_LEVEL);
+    if (ZSTD_isError(compressedSize)) JAFFAR_THROW_RUNTIME("Could not compress delta: %s\n", ZSTD_getErrorName(compressedSize));
+    delta.data.assign(_compressed.begin(), _compressed.begin() + compressedSize);
+  }
+
+  // Turns a buffer equal to the one a delta was encoded against into the one it was encoded from
+  void apply(const delta_t &delta, uint8_t *buffer)
+  {
+    if (delta.rawSize == 0) return;
+
+    const auto decompressedSize = ZSTD_decompressDCtx(_decompressionContext, _staging.data(), _staging.size(), delta.data.data(), delta.data.size());
+    if (ZSTD_isError(decompressedSize)) JAFFAR_THROW_RUNTIME("Could not decompress delta: %s\n", ZSTD_getErrorName(decompressedSize));
+    if (decompressedSize != delta.rawSize) JAFFAR_THROW_RUNTIME("Corrupted delta: expected %lu bytes, got %lu\n", delta.rawSize, decompressedSize);
+
+    size_t stagedPosition = 0;
+    for (const auto chunk : delta.chunks)
+    {
+      const size_t offset = (size_t)chunk * _DELTA_CODEC_CHUNK_SIZE;
+      const size_t size = std::min((size_t)_DELTA_CODEC_CHUNK_SIZE, _bufferSize - offset);
+      for (size_t j = 0; j < size; j++) buffer[offset + j] ^= _staging[stagedPosition + j];
+      stagedPosition += size;
+    }
+  }
+
+  private:
+
+  const size_t _bufferSize;
+  const size_t _chunkCount;
+
+  // Changed chunks before compression and after decompression
+  std::vector<uint8_t> _staging;
+
+  // Compression output, of the worst case size
+  std::vector<uint8_t> _compressed;
+
+  ZSTD_CCtx *_compressionContext;
+  ZSTD_DCtx *_decompressionContext;
+};
+
+} // namespace jaffar
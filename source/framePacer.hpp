@@ -0,0 +1,88 @@
+#pragma once
+
+// Real-time frame pacing for playback
+// Frame deadlines are kept on an absolute schedule (start time + frame count * frame time), so that sleeping late
+// never accumulates into drift. The wait sleeps until shortly before the deadline and spins for the rest, as sleeps
+// alone overshoot by the scheduler's granularity. Whenever presentation falls more than a frame behind, the frames
+// that can no longer be shown on time are dropped (skipped) to stay in real time, and counted.
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace jaffar
+{
+
+// PSP native frame time (1001/60000 s, ~59.94 Hz), in nanoseconds
+#define _NATIVE_FRAME_TIME 16683333
+
+// Margin before a deadline within which the pacer spins instead of sleeping, in nanoseconds
+#define _FRAME_PACER_SPIN_MARGIN 1000000
+
+// Speeds available for playback, as multipliers of the native rate. Zero means unthrottled
+#define _FRAME_PACER_MIN_SPEED 0.25
+#define _FRAME_PACER_MAX_SPEED 16.0
+
+class FramePacer
+{
+  public:
+
+  using clock_t = std::chrono::steady_clock;
+
+  // Sets the playback speed as a multiplier of the native rate, or zero to run unthrottled. Restarts the schedule
+  void setSpeed(const double speed)
+  {
+    _speed = speed;
+    _frameTime = speed > 0.0 ? std::chrono::nanoseconds((int64_t)((double)_NATIVE_FRAME_TIME / speed)) : std::chrono::nanoseconds(0);
+    start();
+  }
+
+  double getSpeed() const { return _speed; }
+  bool isUnthrottled() const { return _speed == 0.0; }
+
+  // Starts a new schedule, with the first frame due one frame time from now
+  void start()
+  {
+    _startTime = clock_t::now();
+    _frameCount = 0;
+  }
+
+  // Waits until the next frame is due. Returns how many frames to move forward: one, plus the frames dropped
+  // for running late
+  size_t waitForNextFrame()
+  {
+    if (isUnthrottled()) return 1;
+
+    _frameCount++;
+    auto deadline = _startTime + _frameCount * _frameTime;
+    auto now = clock_t::now();
+
+    // Running late by a frame or more: dropping the frames missed and presenting the most recent one right away
+    if (now >= deadline + _frameTime)
+    {
+      const uint64_t lateFrames = (now - deadline) / _frameTime;
+      _frameCount += lateFrames;
+      _droppedFrames += lateFrames;
+      return 1 + lateFrames;
+    }
+
+    // Sleeping through most of the wait, and spinning for the rest
+    if (deadline - now > std::chrono::nanoseconds(_FRAME_PACER_SPIN_MARGIN)) std::this_thread::sleep_until(deadline - std::chrono::nanoseconds(_FRAME_PACER_SPIN_MARGIN));
+    while (clock_t::now() < deadline);
+
+    return 1;
+  }
+
+  uint64_t getDroppedFrames() const { return _droppedFrames; }
+  void resetDroppedFrames() { _droppedFrames = 0; }
+
+  private:
+
+  double _speed = 1.0;
+  std::chrono::nanoseconds _frameTime = std::chrono::nanoseconds(_NATIVE_FRAME_TIME);
+  clock_t::time_point _startTime = clock_t::now();
+  uint64_t _frameCount = 0;
+  uint64_t _droppedFrames = 0;
+};
+
+} // namespace jaffar
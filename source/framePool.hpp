@@ -0,0 +1,99 @@
+#pragma once
+
+// Content-addressed pool of video frames
+// Frames are keyed by their 128-bit hash, so that identical frames (menus, lag frames, loading screens) share a
+// single reference-counted copy. A hash match is confirmed by comparing contents. On a collision, the frame goes
+// under the next free key instead (probing linearly), so the key returned always identifies the inserted contents.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <jaffarCommon/hash.hpp>
+#include <jaffarCommon/exceptions.hpp>
+#include "hashKernel.hpp"
+
+namespace jaffar
+{
+
+class FramePool
+{
+  public:
+
+  FramePool(const size_t frameSize) : _frameSize(frameSize) {}
+
+  FramePool(const FramePool &) = delete;
+  FramePool &operator=(const FramePool &) = delete;
+
+  ~FramePool()
+  {
+    for (auto &entry : _entries) free(entry.second.data);
+  }
+
+  // Adds a reference to the given frame's contents, copying them only if they are not pooled yet
+  const uint8_t *insert(const uint8_t *frame, jaffarCommon::hash::hash_t &key)
+  {
+    _insertions++;
+    key = hashKernel::hash(frame, _frameSize);
+
+    for (auto it = _entries.find(key); it != _entries.end(); it = _entries.find(key))
+    {
+      if (memcmp(it->second.data, frame, _frameSize) == 0)
+      {
+        _hits++;
+        it->second.refCount++;
+        return it->second.data;
+      }
+
+      _collisions++;
+      key.second++;
+    }
+
+    entry_t entry;
+    entry.data = (uint8_t *)malloc(_frameSize);
+    entry.refCount = 1;
+    memcpy(entry.data, frame, _frameSize);
+    _entries[key] = entry;
+    return entry.data;
+  }
+
+  // Drops a reference to a pooled frame, freeing it with the last one
+  void release(const jaffarCommon::hash::hash_t &key)
+  {
+    auto it = _entries.find(key);
+    if (it == _entries.end()) JAFFAR_THROW_LOGIC("Releasing a frame not in the pool\n");
+    if (--it->second.refCount > 0) return;
+    free(it->second.data);
+    _entries.erase(it);
+  }
+
+  size_t getInsertions() const { return _insertions; }
+  size_t getHits() const { return _hits; }
+  size_t getCollisions() const { return _collisions; }
+  double getHitRate() const { return _insertions > 0 ? (double)_hits / (double)_insertions : 0.0; }
+  size_t getFrameCount() const { return _entries.size(); }
+  size_t getStorageSize() const { return _entries.size() * _frameSize; }
+
+  private:
+
+  struct entry_t
+  {
+    uint8_t *data;
+    size_t refCount;
+  };
+
+  // The key is already a well-mixed hash
+  struct keyHasher_t
+  {
+    size_t operator()(const jaffarCommon::hash::hash_t &key) const { return key.first; }
+  };
+
+  const size_t _frameSize;
+  std::unordered_map<jaffarCommon::hash::hash_t, entry_t, keyHasher_t> _entries;
+
+  size_t _insertions = 0;
+  size_t _hits = 0;
+  size_t _collisions = 0;
+};
+
+} // namespace jaffar
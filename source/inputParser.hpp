@@ -3,40 +3,70 @@
 // Base controller class
 // by eien86
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
 #include <jaffarCommon/exceptions.hpp>
 #include <jaffarCommon/json.hpp>
 #include <string>
-#include <sstream>
+#include <string_view>
 
 namespace jaffar
 {
 
+// Number of characters taken by each analog value in an input string
+#define _ANALOG_FIELD_WIDTH 6
+
+// Buttons, in the order of libretro's joypad ids, so that the core's bitmask queries map directly onto them
+enum class button_t : uint8_t { cross = 0, square, select, start, up, down, left, right, circle, triangle, ltrigger, rtrigger, power, home };
+
+// Analog axes, in the order of libretro's (index, id) pairs
+enum class analog_t : uint8_t { leftX = 0, leftY, rightX, rightY };
+
+constexpr uint16_t buttonMask(const button_t button) { return 1u << (uint8_t)button; }
+
+// The core turns each analog value into an 8-bit stick position, as ceil(value / 32767 * 127.5 + 127.5) clamped to
+// [0, 255] in single precision (see libretro.cpp and __CtrlSetAnalogXY). This is all the PSP ever sees of it
+inline uint8_t getAnalogStickPosition(const int16_t value)
+{
+  const int position = (int)ceilf((float)value / 32767.0f * 127.5f + 127.5f);
+  return (uint8_t)std::clamp(position, 0, 255);
+}
+
+// Analog values are kept as the stick position they produce, stored as an offset from the center. Any value is accepted
+// and replays the same, while reading it back gives its canonical form: the offset times 256, which reaches the same
+// position for all 256 of them (e.g., 32767 reads back as 32512, and 1 as 0)
+inline int8_t packAnalog(const int16_t value) { return (int8_t)(getAnalogStickPosition(value) - 128); }
+constexpr int16_t unpackAnalog(const int8_t value) { return (int16_t)value * 256; }
+
+// Packed input: a button mask plus one byte per analog axis, so that inputs can be compared, hashed and stored cheaply
 struct input_t
 {
-  // Player inputs
-  bool up = false;
-  bool down = false;
-  bool left = false;
-  bool right = false;
-  bool start = false;
-  bool select = false;
-  bool square = false;
-  bool triangle = false;
-  bool circle = false;
-  bool cross = false;
-  bool ltrigger = false;
-  bool rtrigger = false;
-  int32_t rightAnalogX = 0;
-  int32_t rightAnalogY = 0;
-  int32_t leftAnalogX = 0;
-  int32_t leftAnalogY = 0;
-
-  // Console inputs
-  bool power = false;
-  bool home = false;
+  uint16_t buttons = 0;
+  int8_t analogs[4] = { 0, 0, 0, 0 };
+
+  inline bool isPressed(const button_t button) const { return (buttons & buttonMask(button)) != 0; }
+  inline void setButton(const button_t button, const bool pressed) { buttons = pressed ? (buttons | buttonMask(button)) : (buttons & ~buttonMask(button)); }
+
+  inline int16_t getAnalog(const analog_t axis) const { return unpackAnalog(analogs[(uint8_t)axis]); }
+  inline void setAnalog(const analog_t axis, const int16_t value) { analogs[(uint8_t)axis] = packAnalog(value); }
+
+  // The whole input as a single integer
+  inline uint64_t toInteger() const
+  {
+    uint64_t value = 0;
+    memcpy(&value, this, sizeof(input_t));
+    return value;
+  }
+
+  bool operator==(const input_t &other) const = default;
 };
 
+static_assert(sizeof(input_t) == 6, "Inputs are expected to be packed into six bytes");
+
 class InputParser
 {
 public:
@@ -47,192 +77,154 @@ public:
   {
   }
 
-  inline input_t parseInputString(const std::string &inputString) const
+  inline input_t parseInputString(const std::string_view inputString) const
   {
     // Storage for the input
     input_t input;
 
-    // Currently read character
-    char c;
-
-    // Converting input into a stream for parsing
-    std::istringstream ss(inputString);
+    // Current position within the string
+    size_t pos = 0;
 
     // Input separator
-    c = ss.get();
-    if (c != '|') reportBadInputString(inputString, c);
+    parseSeparator(inputString, pos, '|');
 
     // Parsing console inputs
-    parseConsoleInput(input, ss, inputString);
+    parseConsoleInput(input, inputString, pos);
 
     // Input separator
-    c = ss.get();
-    if (c != '|') reportBadInputString(inputString, c);
-    
+    parseSeparator(inputString, pos, '|');
+
     // Parsing controller 1 inputs
-    parseGamepadInput(input, ss, inputString);
+    parseGamepadInput(input, inputString, pos);
 
     // End separator
-    c = ss.get();
-    if (c != '|') reportBadInputString(inputString, c);
+    parseSeparator(inputString, pos, '|');
+
+    // If its not the end of the string, then extra values remain and its invalid
+    if (pos != inputString.size()) reportBadInputString(inputString, inputString[pos]);
 
-    // If its not the end of the stream, then extra values remain and its invalid
-    c = ss.get();
-    if (ss.eof() == false) reportBadInputString(inputString, c);
-    
     // Returning input
     return input;
   };
 
+  // Produces the text representation of an input, as accepted by parseInputString
+  inline std::string inputToString(const input_t &input) const
+  {
+    const auto b = [&input](const button_t button, const char symbol) { return input.isPressed(button) ? symbol : '.'; };
+
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "|%c%c|%c%c%c%c%c%c%c%c%c%c%c%c|%6d,%6d,%6d,%6d|",
+      b(button_t::home, 'h'), b(button_t::power, 'P'),
+      b(button_t::up, 'U'), b(button_t::down, 'D'), b(button_t::left, 'L'), b(button_t::right, 'R'),
+      b(button_t::start, 'S'), b(button_t::select, 's'), b(button_t::square, 'Q'), b(button_t::triangle, 'T'),
+      b(button_t::circle, 'C'), b(button_t::cross, 'X'), b(button_t::ltrigger, 'l'), b(button_t::rtrigger, 'r'),
+      input.getAnalog(analog_t::rightX), input.getAnalog(analog_t::rightY), input.getAnalog(analog_t::leftX), input.getAnalog(analog_t::leftY));
+    return std::string(buffer);
+  }
+
   private:
 
-  static void parseConsoleInput(input_t& input, std::istringstream& ss, const std::string& inputString)
+  static inline char getChar(const std::string_view inputString, size_t &pos)
+  {
+    if (pos >= inputString.size()) reportBadInputString(inputString, '\0');
+    return inputString[pos++];
+  }
+
+  static inline void parseSeparator(const std::string_view inputString, size_t &pos, const char separator)
+  {
+    const char c = getChar(inputString, pos);
+    if (c != separator) reportBadInputString(inputString, c);
+  }
+
+  // A button is either pressed (its symbol) or released ('.')
+  static inline bool parseButton(const std::string_view inputString, size_t &pos, const char symbol)
+  {
+    const char c = getChar(inputString, pos);
+    if (c != '.' && c != symbol) reportBadInputString(inputString, c);
+    return c == symbol;
+  }
+
+  // A button is either pressed (its symbol) or released ('.')
+  static inline void parseButton(input_t &input, const button_t button, const std::string_view inputString, size_t &pos, const char symbol)
+  {
+    input.setButton(button, parseButton(inputString, pos, symbol));
+  }
+
+  // Analog values are right-aligned, space-padded, signed 16-bit integers of fixed width
+  static inline int16_t parseAnalog(const std::string_view inputString, size_t &pos)
+  {
+    if (pos + _ANALOG_FIELD_WIDTH > inputString.size()) reportBadInputString(inputString, '\0');
+    const size_t end = pos + _ANALOG_FIELD_WIDTH;
+
+    while (pos < end && inputString[pos] == ' ') pos++;
+
+    bool isNegative = false;
+    if (pos < end && (inputString[pos] == '-' || inputString[pos] == '+')) isNegative = inputString[pos++] == '-';
+
+    int32_t value = 0;
+    while (pos < end && inputString[pos] >= '0' && inputString[pos] <= '9') value = value * 10 + (inputString[pos++] - '0');
+
+    if (pos != end) reportBadInputString(inputString, inputString[pos]);
+    if (isNegative) value = -value;
+    if (value < INT16_MIN || value > INT16_MAX) reportBadInputString(inputString, inputString[pos - 1]);
+    return value;
+  }
+
+  static void parseConsoleInput(input_t& input, const std::string_view inputString, size_t &pos)
   {
-    // Currently read character
-    char c;
-
-    c = ss.get();
-    if (c != '.' && c != 'h') reportBadInputString(inputString, c);
-    if (c == 'h') input.home = true;
-    if (c == '.') input.home = false;
-
-    c = ss.get();
-    if (c != '.' && c != 'P') reportBadInputString(inputString, c);
-    if (c == 'P') input.power = true;
-    if (c == '.') input.power = false;
+    parseButton(input, button_t::home, inputString, pos, 'h');
+    parseButton(input, button_t::power, inputString, pos, 'P');
   }
 
-  static void parseGamepadInput(input_t& input, std::istringstream& ss, const std::string& inputString)
+  static void parseGamepadInput(input_t& input, const std::string_view inputString, size_t &pos)
   {
-    // Currently read character
-    char c;
-
-    // Up
-    c = ss.get();
-    if (c != '.' && c != 'U') reportBadInputString(inputString, c);
-    if (c == 'U') input.up = true;
-
-    // Down
-    c = ss.get();
-    if (c != '.' && c != 'D') reportBadInputString(inputString, c);
-    if (c == 'D') input.down = true;
-
-    // Left
-    c = ss.get();
-    if (c != '.' && c != 'L') reportBadInputString(inputString, c);
-    if (c == 'L') input.left = true;
-
-    // Right
-    c = ss.get();
-    if (c != '.' && c != 'R') reportBadInputString(inputString, c);
-    if (c == 'R') input.right = true;
-
-    // Start
-    c = ss.get();
-    if (c != '.' && c != 'S') reportBadInputString(inputString, c);
-    if (c == 'S') input.start = true;
-
-    // Select
-    c = ss.get();
-    if (c != '.' && c != 's') reportBadInputString(inputString, c);
-    if (c == 's') input.select = true;
-
-    // Button Square
-    c = ss.get();
-    if (c != '.' && c != 'Q') reportBadInputString(inputString, c );
-    if (c == 'Q') input.square = true;
-
-    // Button Triangle
-    c = ss.get();
-    if (c != '.' && c != 'T') reportBadInputString(inputString, c);
-    if (c == 'T') input.triangle = true;
-
-    // Button Circle
-    c = ss.get();
-    if (c != '.' && c != 'C') reportBadInputString(inputString, c);
-    if (c == 'C') input.circle = true;
-        
-    // Button Cross
-    c = ss.get();
-    if (c != '.' && c != 'X') reportBadInputString(inputString, c);
-    if (c == 'X') input.cross = true;
-    
-    // Button L Trigger
-    c = ss.get();
-    if (c != '.' && c != 'l') reportBadInputString(inputString, c);
-    if (c == 'l') input.ltrigger = true;
-
-    // Button R Trigger
-    c = ss.get();
-    if (c != '.' && c != 'r') reportBadInputString(inputString, c);
-    if (c == 'r') input.rtrigger = true;
+    parseButton(input, button_t::up, inputString, pos, 'U');
+    parseButton(input, button_t::down, inputString, pos, 'D');
+    parseButton(input, button_t::left, inputString, pos, 'L');
+    parseButton(input, button_t::right, inputString, pos, 'R');
+    parseButton(input, button_t::start, inputString, pos, 'S');
+    parseButton(input, button_t::select, inputString, pos, 's');
+    parseButton(input, button_t::square, inputString, pos, 'Q');
+    parseButton(input, button_t::triangle, inputString, pos, 'T');
+    parseButton(input, button_t::circle, inputString, pos, 'C');
+    parseButton(input, button_t::cross, inputString, pos, 'X');
+    parseButton(input, button_t::ltrigger, inputString, pos, 'l');
+    parseButton(input, button_t::rtrigger, inputString, pos, 'r');
 
     // Parsing Separator
-    c = ss.get();
-    if (c != '|') reportBadInputString(inputString, c);
-
-    // Parsing Right Analog X
-    char rightAnalogXString[7];
-    rightAnalogXString[0] = ss.get();
-    rightAnalogXString[1] = ss.get();
-    rightAnalogXString[2] = ss.get();
-    rightAnalogXString[3] = ss.get();
-    rightAnalogXString[4] = ss.get();
-    rightAnalogXString[5] = ss.get();
-    rightAnalogXString[6] = '\0';
-    input.rightAnalogX = atoi(rightAnalogXString);
-
-    // Parsing comma
-    c = ss.get();
-    if (c != ',') reportBadInputString(inputString, c);
-
-    // Parsing Right Analog Y
-    char rightAnalogYString[7];
-    rightAnalogYString[0] = ss.get();
-    rightAnalogYString[1] = ss.get();
-    rightAnalogYString[2] = ss.get();
-    rightAnalogYString[3] = ss.get();
-    rightAnalogYString[4] = ss.get();
-    rightAnalogYString[5] = ss.get();
-    rightAnalogYString[6] = '\0';
-    input.rightAnalogY = atoi(rightAnalogYString);
-
-    // Parsing comma
-    c = ss.get();
-    if (c != ',') reportBadInputString(inputString, c);
-
-    // Parsing Left Analog X
-    char leftAnalogXString[7];
-    leftAnalogXString[0] = ss.get();
-    leftAnalogXString[1] = ss.get();
-    leftAnalogXString[2] = ss.get();
-    leftAnalogXString[3] = ss.get();
-    leftAnalogXString[4] = ss.get();
-    leftAnalogXString[5] = ss.get();
-    leftAnalogXString[6] = '\0';
-    input.leftAnalogX = atoi(leftAnalogXString);
-
-    // Parsing comma
-    c = ss.get();
-    if (c != ',') reportBadInputString(inputString, c);
-
-    // Parsing Left Analog Y
-    char leftAnalogYString[7];
-    leftAnalogYString[0] = ss.get();
-    leftAnalogYString[1] = ss.get();
-    leftAnalogYString[2] = ss.get();
-    leftAnalogYString[3] = ss.get();
-    leftAnalogYString[4] = ss.get();
-    leftAnalogYString[5] = ss.get();
-    leftAnalogYString[6] = '\0';
-    input.leftAnalogY = atoi(leftAnalogYString);
+    parseSeparator(inputString, pos, '|');
+
+    // Parsing analog axes, separated by commas
+    input.setAnalog(analog_t::rightX, parseAnalog(inputString, pos));
+    parseSeparator(inputString, pos, ',');
+    input.setAnalog(analog_t::rightY, parseAnalog(inputString, pos));
+    parseSeparator(inputString, pos, ',');
+    input.setAnalog(analog_t::leftX, parseAnalog(inputString, pos));
+    parseSeparator(inputString, pos, ',');
+    input.setAnalog(analog_t::leftY, parseAnalog(inputString, pos));
   }
 
-  static inline void reportBadInputString(const std::string &inputString, const char c)
+  static inline void reportBadInputString(const std::string_view inputString, const char c)
   {
-    JAFFAR_THROW_LOGIC("Could not decode input string: '%s' - Read: '%c'\n", inputString.c_str(), c);
+    JAFFAR_THROW_LOGIC("Could not decode input string: '%s' - Read: '%c'\n", std::string(inputString).c_str(), c);
   }
 
 }; // class InputParser
 
-} // namespace jaffar
\ No newline at end of file
+} // namespace jaffar
+
+template <>
+struct std::hash<jaffar::input_t>
+{
+  size_t operator()(const jaffar::input_t &input) const
+  {
+    // Mixing the packed input (fmix64 finalizer), as its raw value has most bits at zero
+    uint64_t h = input.toInteger();
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+  }
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+// Low-overhead latency histogram
+// Values (in nanoseconds) fall into log-linear buckets: each power of two is split into 32 linear sub-buckets,
+// so recording is a couple of bit operations and percentiles are accurate to within ~3%.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+
+namespace jaffar
+{
+
+#define _HISTOGRAM_SUB_BUCKET_BITS 5
+#define _HISTOGRAM_SUB_BUCKET_COUNT (1u << _HISTOGRAM_SUB_BUCKET_BITS)
+#define _HISTOGRAM_BUCKET_COUNT ((64 - _HISTOGRAM_SUB_BUCKET_BITS + 1) * _HISTOGRAM_SUB_BUCKET_COUNT)
+
+class LatencyHistogram
+{
+  public:
+
+  inline void record(const uint64_t value)
+  {
+    _buckets[getBucket(value)]++;
+    _count++;
+    _sum += value;
+    _min = std::min(_min, value);
+    _max = std::max(_max, value);
+  }
+
+  uint64_t getCount() const { return _count; }
+  uint64_t getSum() const { return _sum; }
+  uint64_t getMin() const { return _count > 0 ? _min : 0; }
+  uint64_t getMax() const { return _max; }
+  double getMean() const { return _count > 0 ? (double)_sum / (double)_count : 0.0; }
+
+  // Value below which the given fraction (0.0 to 1.0) of the recorded values fall, clamped to the observed range
+  uint64_t getPercentile(const double fraction) const
+  {
+    if (_count == 0) return 0;
+
+    const uint64_t target = std::max((uint64_t)1, (uint64_t)(fraction * (double)_count + 0.5));
+    uint64_t accumulated = 0;
+    for (size_t i = 0; i < _HISTOGRAM_BUCKET_COUNT; i++)
+    {
+      accumulated += _buckets[i];
+      if (accumulated >= target) return std::clamp(getBucketUpperBound(i), getMin(), getMax());
+    }
+
+    return _max;
+  }
+
+  private:
+
+  static inline size_t getBucket(const uint64_t value)
+  {
+    // Small values map one to one
+    if (value < _HISTOGRAM_SUB_BUCKET_COUNT) return value;
+
+    // Otherwise, the position of the highest bit selects the range and the following bits the sub-bucket
+    const size_t exponent = 63 - __builtin_clzll(value);
+    const size_t subBucket = (value >> (exponent - _HISTOGRAM_SUB_BUCKET_BITS)) & (_HISTOGRAM_SUB_BUCKET_COUNT - 1);
+    return (exponent - _HISTOGRAM_SUB_BUCKET_BITS + 1) * _HISTOGRAM_SUB_BUCKET_COUNT + subBucket;
+  }
+
+  static inline uint64_t getBucketUpperBound(const size_t bucket)
+  {
+    if (bucket < _HISTOGRAM_SUB_BUCKET_COUNT) return bucket;
+
+    const size_t exponent = bucket / _HISTOGRAM_SUB_BUCKET_COUNT + _HISTOGRAM_SUB_BUCKET_BITS - 1;
+    const uint64_t subBucket = bucket % _HISTOGRAM_SUB_BUCKET_COUNT;
+    const size_t shift = exponent - _HISTOGRAM_SUB_BUCKET_BITS;
+    const uint64_t lowerBound = ((uint64_t)_HISTOGRAM_SUB_BUCKET_COUNT + subBucket) << shift;
+    return lowerBound + ((uint64_t)1 << shift) - 1;
+  }
+
+  std::array<uint64_t, _HISTOGRAM_BUCKET_COUNT> _buckets{};
+  uint64_t _count = 0;
+  uint64_t _sum = 0;
+  uint64_t _min = std::numeric_limits<uint64_t>::max();
+  uint64_t _max = 0;
+};
+
+} // namespace jaffar
@@ -1,110 +1,138 @@
 #pragma once
 
 #include "emuInstance.hpp"
+#include "deltaCodec.hpp"
+#include "framePool.hpp"
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include <jaffarCommon/hash.hpp>
 #include <jaffarCommon/exceptions.hpp>
 
-#define _INVERSE_FRAME_RATE 66667
+// Default number of recently decoded (non-keyframe) steps kept in memory
+#define _DEFAULT_STEP_CACHE_SIZE 16
+
+// Default number of steps between full states when storing the rest as deltas
+#define _DEFAULT_DELTA_KEYFRAME_INTERVAL 64
 
 struct stepData_t
 {
   jaffar::input_t inputData;
   std::string inputString;
   uint8_t *stateData;
-  uint8_t *videoBuffer;
+  const uint8_t *videoBuffer;
+  jaffarCommon::hash::hash_t videoKey;
+  jaffar::delta_t stateDelta;
+  jaffar::delta_t videoDelta;
   jaffarCommon::hash::hash_t hash;
 };
 
+// Only every N-th step (a keyframe) keeps its full state and video buffer. Any other step is either re-simulated
+// from the closest earlier keyframe or cached step when requested or, with delta storage, rebuilt from there by
+// applying the compressed XOR deltas stored for each step. Decoded steps are kept in a small LRU cache.
+// Stored video frames are shared among steps with identical contents through a content-addressed pool
 class PlaybackInstance
 {
   public:
 
   // Initializes the playback module instance
-  PlaybackInstance(jaffar::EmuInstance *emu, const std::vector<std::string> &sequence, const std::string& cycleType) :
-   _emu(emu)
+  PlaybackInstance(jaffar::EmuInstance *emu, const std::vector<jaffar::input_t> &sequence, const std::string& cycleType, const size_t keyframeInterval = 1, const size_t stepCacheSize = _DEFAULT_STEP_CACHE_SIZE, const bool useDeltaStorage = false, const bool generateInBackground = false) :
+   _sequence(sequence),
+   _emu(emu),
+   _framePool(emu->getVideoBufferSize()),
+   _cycleType(cycleType),
+   _keyframeInterval(keyframeInterval),
+   _useDeltaStorage(useDeltaStorage)
   {
+    if (_keyframeInterval == 0) JAFFAR_THROW_LOGIC("[Error] The keyframe interval must be at least 1");
+
     // Getting video buffer size
     _videoBufferSize = _emu->getVideoBufferSize();
-    _videoBufferPtr = _emu->getVideoBufferPtr();
 
     // Getting full state size
-    _fullStateSize = _emu->getStateSize();  
+    _fullStateSize = _emu->getStateSize();
 
-    // Allocating temporary state data 
-    uint8_t* stateData = (uint8_t*)malloc(_fullStateSize);
+    // Allocating temporary state data
+    _tmpStateData = (uint8_t*)malloc(_fullStateSize);
 
-    // Getting input decoder
-    auto inputParser = _emu->getInputParser();
+    // Allocating storage for the generation state and video buffer, while the emulator is borrowed to decode a step
+    _resumeStateData = (uint8_t*)malloc(_fullStateSize);
+    _resumeVideoBuffer = (uint8_t*)malloc(_videoBufferSize);
 
-    // Building sequence information
-    for (size_t i = 0; i < sequence.size(); i++)
+    // Creating delta encoders and the buffers holding the current and previous steps, if storing deltas
+    if (_useDeltaStorage == true)
     {
-      // Adding new step
-      stepData_t step;
-      step.inputString = sequence[i];
-      step.inputData = inputParser->parseInputString(step.inputString);
-
-      // Serializing state
-      jaffarCommon::serializer::Contiguous s(stateData, _fullStateSize);
-      _emu->serializeState(s);
-      step.hash = _emu->getStateHash();
-
-      // Saving step data
-      step.stateData = (uint8_t *)malloc(_fullStateSize);
-      memcpy(step.stateData, stateData, _fullStateSize);
-
-      // Creating step's video buffer
-      step.videoBuffer = (uint8_t *)malloc(_videoBufferSize);
-      memcpy(step.videoBuffer, _videoBufferPtr, _videoBufferSize); 
+      _stateCodec = std::make_unique<jaffar::DeltaCodec>(_fullStateSize);
+      _videoCodec = std::make_unique<jaffar::DeltaCodec>(_videoBufferSize);
+      for (size_t i = 0; i < 2; i++) { _deltaStateData[i].resize(_fullStateSize); _deltaVideoBuffer[i].resize(_videoBufferSize); }
+    }
 
-      // Adding the step into the sequence
-      _stepSequence.push_back(step);
+    // Allocating the decoded step cache, which is not needed if every step is a keyframe
+    if (_keyframeInterval > 1) _stepCache.resize(std::max((size_t)1, stepCacheSize));
+    for (auto &entry : _stepCache)
+    {
+      entry.stepId = _noStep;
+      entry.lastUsed = 0;
+      entry.stateData = (uint8_t *)malloc(_fullStateSize);
+      entry.videoBuffer = (uint8_t *)malloc(_videoBufferSize);
+    }
 
-      // We advance depending on cycle type
-      if (cycleType == "Simple")
-      {
-        _emu->advanceState(step.inputData );
-      }
+    // Allocating all steps upfront, plus a last one with no input, so that they never move while being generated
+    _stepSequence.resize(_sequence.size() + 1);
+    for (auto &step : _stepSequence) { step.stateData = nullptr; step.videoBuffer = nullptr; }
 
-      if (cycleType == "Rerecord")
-      {
-        _emu->advanceState(step.inputData );
-        jaffarCommon::deserializer::Contiguous d(stateData, _fullStateSize);
-        _emu->deserializeState(d);
-        _emu->advanceState(step.inputData );
-      }
+    // Generating the steps, either right away or on a worker thread while they are browsed
+    _isGenerating = true;
+    if (generateInBackground == true) _generationThread = std::thread([this]() { generateSteps(); });
+    else
+    {
+      generateSteps();
+      if (_generationError != nullptr) std::rethrow_exception(_generationError);
     }
+  }
 
-    // Adding last step with no input
-    stepData_t step;
-    step.inputString = "<End Of Sequence>";
-    step.inputData = _stepSequence.rbegin()->inputData;
-    step.stateData = (uint8_t *)malloc(_fullStateSize);
-    jaffarCommon::serializer::Contiguous s(step.stateData, _fullStateSize);
+  PlaybackInstance(const PlaybackInstance &) = delete;
+  PlaybackInstance &operator=(const PlaybackInstance &) = delete;
 
-    _emu->serializeState(s);
-    step.hash = _emu->getStateHash();
+  ~PlaybackInstance()
+  {
+    stopGeneration();
+    for (auto &step : _stepSequence) if (step.stateData != nullptr) { free(step.stateData); _framePool.release(step.videoKey); }
+    for (auto &entry : _stepCache) { free(entry.stateData); free(entry.videoBuffer); }
+    free(_tmpStateData);
+    free(_resumeStateData);
+    free(_resumeVideoBuffer);
+  }
 
-    // Adding the step into the sequence
-    _stepSequence.push_back(step);
+  // Stops generating steps (if still running) and waits for the worker thread. Must be called before finalizing the emulator
+  void stopGeneration()
+  {
+    _stopGeneration = true;
+    if (_generationThread.joinable()) _generationThread.join();
+  }
 
-    // Freeing memory
-    free(stateData);
+  bool isGenerating() const { return _isGenerating; }
+
+  // Number of steps that can be browsed so far. Rethrows any error raised while generating them
+  size_t getGeneratedStepCount() const
+  {
+    if (_isGenerating == false && _generationError != nullptr) std::rethrow_exception(_generationError);
+    return _generatedStepCount.load(std::memory_order_acquire);
   }
 
   // Function to render frame
   void renderFrame(const size_t stepId)
   {
     // Checking the required step id does not exceed contents of the sequence
-    if (stepId > _stepSequence.size()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step larger than the step sequence");
-
-    // Updating video buffer
-    const auto &step = _stepSequence[stepId];
-    memcpy(_videoBufferPtr, step.videoBuffer, _videoBufferSize);
+    if (stepId >= getGeneratedStepCount()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step not yet generated");
 
-    // Updating image
-    _emu->updateRenderer();
+    // Displaying the step's video buffer directly, as the emulator's own may be in use generating steps
+    std::lock_guard<std::mutex> lock(_mutex);
+    _emu->updateRenderer(getStepVideoBuffer(stepId));
   }
 
   size_t getSequenceLength() const
@@ -115,7 +143,7 @@ class PlaybackInstance
   const std::string getInputString(const size_t stepId) const
   {
     // Checking the required step id does not exceed contents of the sequence
-    if (stepId > _stepSequence.size()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step larger than the step sequence");
+    if (stepId >= getGeneratedStepCount()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step not yet generated");
 
     // Getting step information
     const auto &step = _stepSequence[stepId];
@@ -127,7 +155,7 @@ class PlaybackInstance
   const jaffar::input_t getInputData(const size_t stepId) const
   {
     // Checking the required step id does not exceed contents of the sequence
-    if (stepId > _stepSequence.size()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step larger than the step sequence");
+    if (stepId >= getGeneratedStepCount()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step not yet generated");
 
     // Getting step information
     const auto &step = _stepSequence[stepId];
@@ -136,22 +164,23 @@ class PlaybackInstance
     return step.inputData;
   }
 
-  const uint8_t *getStateData(const size_t stepId) const
+  // The returned data remains valid until another step is requested
+  const uint8_t *getStateData(const size_t stepId)
   {
     // Checking the required step id does not exceed contents of the sequence
-    if (stepId > _stepSequence.size()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step larger than the step sequence");
+    if (stepId >= getGeneratedStepCount()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step not yet generated");
 
-    // Getting step information
+    // Returning step state, decoding it if required
     const auto &step = _stepSequence[stepId];
-
-    // Returning step input
-    return step.stateData;
+    if (step.stateData != nullptr) return step.stateData;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return getDecodedStep(stepId).stateData;
   }
 
   const jaffarCommon::hash::hash_t getStateHash(const size_t stepId) const
   {
     // Checking the required step id does not exceed contents of the sequence
-    if (stepId > _stepSequence.size()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step larger than the step sequence");
+    if (stepId >= getGeneratedStepCount()) JAFFAR_THROW_RUNTIME("[Error] Attempting to render a step not yet generated");
 
     // Getting step information
     const auto &step = _stepSequence[stepId];
@@ -160,18 +189,304 @@ class PlaybackInstance
     return step.hash;
   }
 
+  size_t getKeyframeInterval() const { return _keyframeInterval; }
+
+  // Memory taken by the stored states, video buffers and deltas, including the decoded step cache
+  size_t getStorageSize() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t storageSize = _stepCache.size() * (_fullStateSize + _videoBufferSize) + _framePool.getStorageSize();
+    for (const auto &step : _stepSequence)
+    {
+      if (step.stateData != nullptr) storageSize += _fullStateSize;
+      storageSize += step.stateDelta.getStorageSize() + step.videoDelta.getStorageSize();
+    }
+    return storageSize;
+  }
+
+  // Pool of the video frames stored in full, for reporting
+  size_t getUniqueFrameCount() const { std::lock_guard<std::mutex> lock(_mutex); return _framePool.getFrameCount(); }
+  double getFramePoolHitRate() const { std::lock_guard<std::mutex> lock(_mutex); return _framePool.getHitRate(); }
+
   private:
-  
+
+  static constexpr size_t _noStep = SIZE_MAX;
+
+  struct cacheEntry_t
+  {
+    size_t stepId;
+    size_t lastUsed;
+    uint8_t *stateData;
+    uint8_t *videoBuffer;
+  };
+
+  inline bool isKeyframe(const size_t stepId) const { return stepId % _keyframeInterval == 0; }
+
+  // Runs the sequence, storing each step as it is reached. The lock is taken one step at a time, so that
+  // already generated steps can be decoded and rendered in between
+  void generateSteps()
+  {
+    try
+    {
+      const auto inputParser = _emu->getInputParser();
+      const size_t lastStepId = _sequence.size();
+
+      for (size_t i = 0; i <= lastStepId && _stopGeneration == false; i++)
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // Advancing from the previous step
+        if (i > 0) advanceStep(_sequence[i - 1]);
+
+        auto &step = _stepSequence[i];
+        step.inputData = i < lastStepId ? _sequence[i] : (lastStepId > 0 ? _sequence[lastStepId - 1] : jaffar::input_t());
+        step.inputString = i < lastStepId ? inputParser->inputToString(step.inputData) : std::string("<End Of Sequence>");
+        step.hash = _emu->getStateHash();
+
+        // Saving the state and video buffer, if this is a keyframe, or its delta against the previous step.
+        // The last step is always a keyframe, as nothing follows to replay it from
+        if (i == lastStepId) storeStep(step);
+        else if (_useDeltaStorage == true) storeDeltaStep(step, isKeyframe(i));
+        else if (isKeyframe(i)) storeStep(step);
+
+        // Making the step visible
+        _generatedStepCount.store(i + 1, std::memory_order_release);
+      }
+
+      // The delta working buffers are no longer needed
+      std::lock_guard<std::mutex> lock(_mutex);
+      for (size_t i = 0; i < 2; i++) { std::vector<uint8_t>().swap(_deltaStateData[i]); std::vector<uint8_t>().swap(_deltaVideoBuffer[i]); }
+    }
+    catch (...) { _generationError = std::current_exception(); }
+
+    _isGenerating = false;
+  }
+
+  // Saves the current emulator state and video buffer into the step
+  void storeStep(stepData_t &step)
+  {
+    step.stateData = (uint8_t *)malloc(_fullStateSize);
+    jaffarCommon::serializer::Contiguous s(step.stateData, _fullStateSize);
+    _emu->serializeState(s);
+    step.videoBuffer = _framePool.insert(_emu->getVideoBufferPtr(), step.videoKey);
+  }
+
+  // Saves the current emulator state in full at keyframes, and otherwise as a delta against the previous step
+  void storeDeltaStep(stepData_t &step, const bool isKeyframe)
+  {
+    auto &currentState = _deltaStateData[_deltaCurrentBuffer];
+    auto &currentVideo = _deltaVideoBuffer[_deltaCurrentBuffer];
+    const auto &previousState = _deltaStateData[1 - _deltaCurrentBuffer];
+    const auto &previousVideo = _deltaVideoBuffer[1 - _deltaCurrentBuffer];
+
+    saveCurrentStep(currentState.data(), currentVideo.data());
+
+    if (isKeyframe == true)
+    {
+      step.stateData = (uint8_t *)malloc(_fullStateSize);
+      memcpy(step.stateData, currentState.data(), _fullStateSize);
+      step.videoBuffer = _framePool.insert(currentVideo.data(), step.videoKey);
+    }
+    else
+    {
+      _stateCodec->encode(step.stateDelta, currentState.data(), previousState.data());
+      _videoCodec->encode(step.videoDelta, currentVideo.data(), previousVideo.data());
+    }
+
+    _deltaCurrentBuffer = 1 - _deltaCurrentBuffer;
+  }
+
+  void saveCurrentStep(uint8_t *stateData, uint8_t *videoBuffer)
+  {
+    jaffarCommon::serializer::Contiguous s(stateData, _fullStateSize);
+    _emu->serializeState(s);
+    memcpy(videoBuffer, _emu->getVideoBufferPtr(), _videoBufferSize);
+  }
+
+  // Advances from the current step to the next one, depending on cycle type
+  void advanceStep(const jaffar::input_t &input)
+  {
+    if (_cycleType == "Simple")
+    {
+      _emu->advanceState(input);
+    }
+
+    if (_cycleType == "Rerecord")
+    {
+      jaffarCommon::serializer::Contiguous s(_tmpStateData, _fullStateSize);
+      _emu->serializeState(s);
+      _emu->advanceState(input);
+      jaffarCommon::deserializer::Contiguous d(_tmpStateData, _fullStateSize);
+      _emu->deserializeState(d);
+      _emu->advanceState(input);
+    }
+  }
+
+  const uint8_t *getStepVideoBuffer(const size_t stepId)
+  {
+    const auto &step = _stepSequence[stepId];
+    if (step.videoBuffer != nullptr) return step.videoBuffer;
+    return getDecodedStep(stepId).videoBuffer;
+  }
+
+  cacheEntry_t *findCachedStep(const size_t stepId)
+  {
+    for (auto &entry : _stepCache) if (entry.stepId == stepId) return &entry;
+    return nullptr;
+  }
+
+  // Finds the closest earlier step with a stored state: either a cached step or the keyframe
+  size_t findStartStep(const size_t stepId, cacheEntry_t *&startEntry)
+  {
+    const size_t keyframeStepId = stepId - stepId % _keyframeInterval;
+    for (size_t i = stepId - 1; i > keyframeStepId; i--)
+    {
+      startEntry = findCachedStep(i);
+      if (startEntry != nullptr) return i;
+    }
+
+    startEntry = nullptr;
+    return keyframeStepId;
+  }
+
+  // Gets a non-keyframe step from the cache, decoding it first if it is not there
+  const cacheEntry_t &getDecodedStep(const size_t stepId)
+  {
+    auto entry = findCachedStep(stepId);
+    if (entry != nullptr)
+    {
+      entry->lastUsed = ++_cacheClock;
+      return *entry;
+    }
+
+    if (_useDeltaStorage == true) return applyDeltas(stepId);
+
+    // Replaying borrows the emulator, so if steps are still being generated, its state is put back afterwards.
+    // The video buffer is not part of the state, but the next step keeps it if the core sends a duplicate frame
+    if (_isGenerating == false) return replaySteps(stepId);
+    jaffarCommon::serializer::Contiguous s(_resumeStateData, _fullStateSize);
+    _emu->serializeState(s);
+    memcpy(_resumeVideoBuffer, _emu->getVideoBufferPtr(), _videoBufferSize);
+    const auto &decodedStep = replaySteps(stepId);
+    jaffarCommon::deserializer::Contiguous d(_resumeStateData, _fullStateSize);
+    _emu->deserializeState(d);
+    memcpy(_emu->getVideoBufferPtr(), _resumeVideoBuffer, _videoBufferSize);
+    return decodedStep;
+  }
+
+  // Rebuilds a step by applying the deltas that lead to it onto the closest earlier stored step
+  const cacheEntry_t &applyDeltas(const size_t stepId)
+  {
+    cacheEntry_t *startEntry;
+    const size_t startStepId = findStartStep(stepId, startEntry);
+
+    // If the entry to reuse is the start step itself, the deltas are applied in place
+    auto entry = getLeastRecentlyUsedEntry();
+    if (entry != startEntry)
+    {
+      const auto &startStep = _stepSequence[startStepId];
+      memcpy(entry->stateData, startEntry != nullptr ? startEntry->stateData : startStep.stateData, _fullStateSize);
+      memcpy(entry->videoBuffer, startEntry != nullptr ? startEntry->videoBuffer : startStep.videoBuffer, _videoBufferSize);
+    }
+
+    for (size_t i = startStepId + 1; i <= stepId; i++)
+    {
+      _stateCodec->apply(_stepSequence[i].stateDelta, entry->stateData);
+      _videoCodec->apply(_stepSequence[i].videoDelta, entry->videoBuffer);
+    }
+
+    entry->stepId = stepId;
+    entry->lastUsed = ++_cacheClock;
+    return *entry;
+  }
+
+  // Re-simulates a step from the closest earlier stored step, caching the steps on the way
+  const cacheEntry_t &replaySteps(const size_t stepId)
+  {
+    cacheEntry_t *startEntry;
+    const size_t startStepId = findStartStep(stepId, startEntry);
+    const uint8_t *startState = startEntry != nullptr ? startEntry->stateData : _stepSequence[startStepId].stateData;
+
+    // The start state may live in a cache entry about to be reused, so copying it out first
+    memcpy(_tmpStateData, startState, _fullStateSize);
+    jaffarCommon::deserializer::Contiguous d(_tmpStateData, _fullStateSize);
+    _emu->deserializeState(d);
+
+    // Replaying up to the requested step
+    cacheEntry_t *entry = nullptr;
+    for (size_t i = startStepId; i < stepId; i++)
+    {
+      advanceStep(_stepSequence[i].inputData);
+      entry = findCachedStep(i + 1);
+      if (entry == nullptr)
+      {
+        entry = getLeastRecentlyUsedEntry();
+        entry->stepId = i + 1;
+        saveCurrentStep(entry->stateData, entry->videoBuffer);
+      }
+      entry->lastUsed = ++_cacheClock;
+    }
+
+    return *entry;
+  }
+
+  cacheEntry_t *getLeastRecentlyUsedEntry()
+  {
+    auto leastRecent = &_stepCache[0];
+    for (auto &entry : _stepCache) if (entry.lastUsed < leastRecent->lastUsed) leastRecent = &entry;
+    return leastRecent;
+  }
+
+  // Inputs to generate the steps from
+  const std::vector<jaffar::input_t> _sequence;
+
   // Internal sequence information
   std::vector<stepData_t> _stepSequence;
 
+  // Background step generation. The mutex guards the emulator, the codecs, the frame pool and the decoded step cache
+  std::thread _generationThread;
+  mutable std::mutex _mutex;
+  std::atomic<size_t> _generatedStepCount = 0;
+  std::atomic<bool> _isGenerating = false;
+  std::atomic<bool> _stopGeneration = false;
+  std::exception_ptr _generationError;
+
+  // Recently decoded steps. The cache is small, so a linear search is enough
+  std::vector<cacheEntry_t> _stepCache;
+  size_t _cacheClock = 0;
+
   // Pointer to the contained emulator instance
   jaffar::EmuInstance *const _emu;
 
+  // Video frames of the steps stored in full
+  jaffar::FramePool _framePool;
+
+  // Emulation actions performed per step
+  const std::string _cycleType;
+
+  // Number of steps between stored full states
+  const size_t _keyframeInterval;
+
+  // Whether the steps between keyframes are stored as deltas, rather than re-simulated
+  const bool _useDeltaStorage;
+  std::unique_ptr<jaffar::DeltaCodec> _stateCodec;
+  std::unique_ptr<jaffar::DeltaCodec> _videoCodec;
+
+  // Current and previous step, while encoding deltas
+  std::vector<uint8_t> _deltaStateData[2];
+  std::vector<uint8_t> _deltaVideoBuffer[2];
+  size_t _deltaCurrentBuffer = 0;
+
+  // Temporary state storage
+  uint8_t *_tmpStateData;
+
+  // Generation state and video buffer, kept while the emulator is borrowed to replay a step
+  uint8_t *_resumeStateData;
+  uint8_t *_resumeVideoBuffer;
+
   // Full size of the game state
   size_t _fullStateSize;
 
   // Video buffer
   size_t _videoBufferSize;
-  uint8_t* _videoBufferPtr;
 };
@@ -6,6 +6,14 @@
 #include "argparse/argparse.hpp"
 #include "emuInstance.hpp"
 #include "playbackInstance.hpp"
+#include "sequenceFile.hpp"
+#include "framePacer.hpp"
+#include "argumentParser.hpp"
+#include <chrono>
+#include <unistd.h>
+
+// Time between display refreshes while steps are being generated (us)
+#define _PROGRESS_REFRESH_PERIOD 100000
 
 int main(int argc, char *argv[])
 {
@@ -17,7 +25,7 @@ int main(int argc, char *argv[])
     .required();
 
   program.add_argument("sequenceFile")
-    .help("Path to the input sequence file (.sol) to reproduce.")
+    .help("Path to the input sequence file to reproduce, either text (.sol) or binary.")
     .required();
 
   program.add_argument("--reproduce")
@@ -25,10 +33,30 @@ int main(int argc, char *argv[])
     .default_value(false)
     .implicit_value(true);
 
+  program.add_argument("--speed")
+    .help("Playback speed, as a multiplier of the native frame rate (0.25 to 16), or 'Unthrottled'.")
+    .default_value(std::string("1"));
+
   program.add_argument("--cycleType")
     .help("Specifies the emulation actions to be performed per each input. Possible values: 'Simple': performs only advance state, 'Rerecord': performs load/advance/save, and 'Full': performs load/advance/save/advance.")
     .default_value(std::string("Simple"));
 
+  program.add_argument("--stepStorage")
+    .help("How the steps between keyframes are stored. Possible values: 'Full': not stored, but re-simulated when requested, 'Delta': stored as compressed differences against the previous step.")
+    .default_value(std::string("Full"));
+
+  program.add_argument("--keyframeInterval")
+    .help("Stores the full state and video buffer only every this many steps. 1 stores every step in full. By default, 1 for 'Full' step storage and 64 for 'Delta'.")
+    .default_value(std::string(""));
+
+  program.add_argument("--stepCacheSize")
+    .help("Number of re-simulated steps kept in memory when using keyframes, for responsive stepping.")
+    .default_value(std::string("16"));
+
+  program.add_argument("--romHashCacheDirectory")
+    .help("Directory to keep rom image hashes in across runs, so that an unchanged image is not hashed again.")
+    .default_value(std::string(""));
+
   program.add_argument("--disableRender")
     .help("Do not render game window.")
     .default_value(false)
@@ -45,6 +73,20 @@ int main(int argc, char *argv[])
   if (cycleType == "Rerecord") cycleTypeRecognized = true;
   if (cycleTypeRecognized == false) JAFFAR_THROW_LOGIC("Unrecognized cycle type: %s\n", cycleType.c_str());
   
+  // Getting step storage settings
+  const auto stepStorage = program.get<std::string>("--stepStorage");
+  if (stepStorage != "Full" && stepStorage != "Delta") JAFFAR_THROW_LOGIC("Unrecognized step storage: %s\n", stepStorage.c_str());
+  const bool useDeltaStorage = stepStorage == "Delta";
+
+  // Getting keyframe settings
+  const auto keyframeIntervalString = program.get<std::string>("--keyframeInterval");
+  const auto stepCacheSizeString = program.get<std::string>("--stepCacheSize");
+  size_t keyframeInterval = useDeltaStorage ? _DEFAULT_DELTA_KEYFRAME_INTERVAL : 1;
+  size_t stepCacheSize = 0;
+  if (keyframeIntervalString != "" && jaffar::argumentParser::parseUnsigned(keyframeIntervalString, keyframeInterval) == false) JAFFAR_THROW_LOGIC("Invalid keyframe interval: %s\n", keyframeIntervalString.c_str());
+  if (jaffar::argumentParser::parseUnsigned(stepCacheSizeString, stepCacheSize) == false) JAFFAR_THROW_LOGIC("Invalid step cache size: %s\n", stepCacheSizeString.c_str());
+  if (keyframeInterval == 0) JAFFAR_THROW_LOGIC("The keyframe interval must be at least 1\n");
+
   // Getting test script file path
   const auto scriptFilePath = program.get<std::string>("scriptFile");
 
@@ -75,16 +117,20 @@ int main(int argc, char *argv[])
   // Getting reproduce flag
   bool isReproduce = program.get<bool>("--reproduce");
 
+  // Getting playback speed
+  const auto speedString = program.get<std::string>("--speed");
+  double playbackSpeed = 0.0;
+  if (speedString != "Unthrottled")
+  {
+    if (jaffar::argumentParser::parseDouble(speedString, playbackSpeed) == false) JAFFAR_THROW_LOGIC("Invalid playback speed: %s\n", speedString.c_str());
+    if (playbackSpeed < _FRAME_PACER_MIN_SPEED || playbackSpeed > _FRAME_PACER_MAX_SPEED) JAFFAR_THROW_LOGIC("Playback speed must be between %.2f and %.2f, or 'Unthrottled'\n", _FRAME_PACER_MIN_SPEED, _FRAME_PACER_MAX_SPEED);
+  }
+
   // Getting reproduce flag
   bool disableRender = program.get<bool>("--disableRender");
 
-  // Loading sequence file
-  std::string inputSequence;
-  auto status = jaffarCommon::file::loadStringFromFile(inputSequence, sequenceFilePath.c_str());
-  if (status == false) JAFFAR_THROW_LOGIC("[ERROR] Could not find or read from sequence file: %s\n", sequenceFilePath.c_str());
-
-  // Building sequence information
-  const auto sequence = jaffarCommon::string::split(inputSequence, '\n');
+  // Loading and decoding the sequence file (text or binary)
+  const auto sequence = jaffar::sequenceFile::load(sequenceFilePath, jaffar::InputParser(configJs));
 
   // Initializing terminal
   jaffarCommon::logger::initializeTerminal();
@@ -94,23 +140,20 @@ int main(int argc, char *argv[])
   jaffarCommon::logger::log("[] Sequence File Path: '%s'\n", sequenceFilePath.c_str());
   jaffarCommon::logger::log("[] Sequence Length:    %lu\n", sequence.size());
   jaffarCommon::logger::log("[] State File Path:    '%s'\n", initialStateFilePath.empty() ? "<Boot Start>" : initialStateFilePath.c_str());
-  jaffarCommon::logger::log("[] Generating Sequence...\n");
+  jaffarCommon::logger::log("[] Step Storage:       '%s' - Keyframe Interval: %lu\n", stepStorage.c_str(), keyframeInterval);
 
   jaffarCommon::logger::refreshTerminal();
 
-  // Loading Rom File
-  std::string romFileData;
-  if (jaffarCommon::file::loadStringFromFile(romFileData, romFilePath) == false) JAFFAR_THROW_LOGIC("Could not rom file: %s\n", romFilePath.c_str());
+  // Creating emulator instance  
+  auto e = jaffar::EmuInstance(configJs);
+  e.setRomHashCacheDirectory(program.get<std::string>("--romHashCacheDirectory"));
 
-  // Calculating Rom SHA1
-  auto romSHA1 = jaffarCommon::hash::getSHA1String(romFileData);
+  // Calculating Rom SHA1 over the mapped rom image
+  const auto romSHA1 = e.getRomSHA1();
 
   // Checking with the expected SHA1 hash
   if (romSHA1 != expectedRomSHA1) JAFFAR_THROW_LOGIC("Wrong Rom SHA1. Found: '%s', Expected: '%s'\n", romSHA1.c_str(), expectedRomSHA1.c_str());
 
-  // Creating emulator instance  
-  auto e = jaffar::EmuInstance(configJs);
-
   // Initializing emulator instance
   if (e.initialize() == false) JAFFAR_THROW_LOGIC("Error initializing emulator\n");
 
@@ -129,8 +172,8 @@ int main(int argc, char *argv[])
     e.deserializeState(d);
   }
 
-  // Creating playback instance
-  auto p = PlaybackInstance(&e, sequence, cycleType);
+  // Creating playback instance. Its steps are generated on a worker thread, and can be browsed as they become available
+  auto p = PlaybackInstance(&e, sequence, cycleType, keyframeInterval, stepCacheSize, useDeltaStorage, true);
 
   // Getting state size
   auto stateSize = e.getStateSize();
@@ -145,9 +188,37 @@ int main(int argc, char *argv[])
   // Flag to display frame information
   bool showFrameInfo = true;
 
+  // Paced playback, which starts right away when reproducing
+  jaffar::FramePacer pacer;
+  pacer.setSpeed(playbackSpeed);
+  bool isPlaying = isReproduce;
+  auto lastInfoTime = std::chrono::steady_clock::now();
+
   // Interactive section
   while (continueRunning)
   {
+    // Waiting for the first step to be generated
+    const bool isGenerating = p.isGenerating();
+    ssize_t generatedSteps = p.getGeneratedStepCount();
+    if (generatedSteps == 0) { usleep(_PROGRESS_REFRESH_PERIOD); continue; }
+
+    // During playback, waiting until the next frame is due, and moving forward as many steps as frames elapsed
+    if (isPlaying)
+    {
+      currentStep += pacer.waitForNextFrame();
+
+      // Reaching the end of the sequence finishes playback, and the player too if reproducing
+      if (currentStep >= sequenceLength - 1)
+      {
+        currentStep = sequenceLength - 1;
+        isPlaying = false;
+        if (isReproduce) continueRunning = false;
+      }
+    }
+
+    // Only steps generated so far can be shown
+    if (currentStep >= generatedSteps) currentStep = generatedSteps - 1;
+
     // Updating display
     if (disableRender == false) p.renderFrame(currentStep);
 
@@ -157,21 +228,29 @@ int main(int argc, char *argv[])
     // Getting state hash
     const auto hash = p.getStateHash(currentStep);
 
-    // Getting state data
-    const auto stateData = p.getStateData(currentStep);
+    // During playback, the frame information is only refreshed periodically, as printing it takes longer than a frame
+    const auto currentTime = std::chrono::steady_clock::now();
+    if (isPlaying && std::chrono::duration_cast<std::chrono::microseconds>(currentTime - lastInfoTime).count() < _PROGRESS_REFRESH_PERIOD) showFrameInfo = false;
 
     // Printing data and commands
     if (showFrameInfo)
     {
+      lastInfoTime = currentTime;
+
       jaffarCommon::logger::clearTerminal();
 
       jaffarCommon::logger::log("[] ----------------------------------------------------------------\n");
       jaffarCommon::logger::log("[] Current Step #: %lu / %lu\n", currentStep + 1, sequenceLength);
       jaffarCommon::logger::log("[] Input:          %s\n", inputString.c_str());
       jaffarCommon::logger::log("[] State Hash:     0x%lX%lX\n", hash.first, hash.second);
+      if (isGenerating) jaffarCommon::logger::log("[] Generating:     %lu / %lu steps (%.1f%%)\n", generatedSteps, sequenceLength, 100.0 * (double)generatedSteps / (double)sequenceLength);
+      jaffarCommon::logger::log("[] Step Storage:   %.2f MB\n", (double)p.getStorageSize() / (1024.0 * 1024.0));
+      jaffarCommon::logger::log("[] Frame Pool:     %lu unique frames - Hit Rate: %.2f%%\n", p.getUniqueFrameCount(), p.getFramePoolHitRate() * 100.0);
+      if (pacer.isUnthrottled()) jaffarCommon::logger::log("[] Playback:       %s at unthrottled speed\n", isPlaying ? "Playing" : "Paused");
+      else jaffarCommon::logger::log("[] Playback:       %s at %.2fx - Dropped Frames: %lu\n", isPlaying ? "Playing" : "Paused", pacer.getSpeed(), pacer.getDroppedFrames());
 
       // Only print commands if not in reproduce mode
-      if (isReproduce == false) jaffarCommon::logger::log("[] Commands: n: -1 m: +1 | h: -10 | j: +10 | y: -100 | u: +100 | k: -1000 | i: +1000 | s: quicksave | p: play | q: quit\n");
+      if (isReproduce == false) jaffarCommon::logger::log("[] Commands: n: -1 m: +1 | h: -10 | j: +10 | y: -100 | u: +100 | k: -1000 | i: +1000 | s: quicksave | p: play/pause | -/+: speed | q: quit\n");
 
       jaffarCommon::logger::refreshTerminal();
     }
@@ -179,8 +258,12 @@ int main(int argc, char *argv[])
     // Resetting show frame info flag
     showFrameInfo = true;
 
-    // Get command
-    auto command = jaffarCommon::logger::waitForKeyPress();
+    // Get command. Keys are only polled during playback, and while steps are still being generated, so that the
+    // display keeps being refreshed
+    int command = 0;
+    if (isPlaying) { if (jaffarCommon::logger::kbhit()) command = jaffarCommon::logger::waitForKeyPress(); }
+    else if (isGenerating == false || jaffarCommon::logger::kbhit()) command = jaffarCommon::logger::waitForKeyPress();
+    else usleep(_PROGRESS_REFRESH_PERIOD);
 
     // Advance/Rewind commands
     if (command == 'n') currentStep = currentStep - 1;
@@ -194,7 +277,7 @@ int main(int argc, char *argv[])
 
     // Correct current step if requested more than possible
     if (currentStep < 0) currentStep = 0;
-    if (currentStep >= sequenceLength) currentStep = sequenceLength - 1;
+    if (currentStep >= generatedSteps) currentStep = generatedSteps - 1;
 
     // Quicksave creation command
     if (command == 's')
@@ -204,7 +287,7 @@ int main(int argc, char *argv[])
 
       std::string saveData;
       saveData.resize(stateSize);
-      memcpy(saveData.data(), stateData, stateSize);
+      memcpy(saveData.data(), p.getStateData(currentStep), stateSize);
       if (jaffarCommon::file::saveStringToFile(saveData, saveFileName.c_str()) == false) JAFFAR_THROW_RUNTIME("[ERROR] Could not save state file: %s\n", saveFileName.c_str());
       jaffarCommon::logger::log("[] Saved state to %s\n", saveFileName.c_str());
 
@@ -212,13 +295,32 @@ int main(int argc, char *argv[])
       showFrameInfo = false;
     }
 
-    // Start playback from current point
-    if (command == 'p') isReproduce = true;
+    // Start or pause playback from current point
+    if (command == 'p')
+    {
+      isPlaying = !isPlaying;
+      pacer.start();
+      pacer.resetDroppedFrames();
+    }
+
+    // Playback speed commands: halving or doubling the speed within the allowed range. Beyond the maximum, unthrottled
+    if (command == '-')
+    {
+      if (pacer.isUnthrottled()) pacer.setSpeed(_FRAME_PACER_MAX_SPEED);
+      else if (pacer.getSpeed() / 2.0 >= _FRAME_PACER_MIN_SPEED) pacer.setSpeed(pacer.getSpeed() / 2.0);
+    }
+    if (command == '+')
+    {
+      if (pacer.isUnthrottled() == false) pacer.setSpeed(pacer.getSpeed() * 2.0 <= _FRAME_PACER_MAX_SPEED ? pacer.getSpeed() * 2.0 : 0.0);
+    }
 
     // Start playback from current point
     if (command == 'q') continueRunning = false;
   }
 
+  // Stopping step generation, as the emulator is about to be finalized
+  p.stopGeneration();
+
   // Finalizing video output
   if (disableRender == false) e.finalizeVideoOutput();
 
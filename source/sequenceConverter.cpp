@@ -0,0 +1,53 @@
+#include "argparse/argparse.hpp"
+#include <jaffarCommon/exceptions.hpp>
+#include <jaffarCommon/json.hpp>
+#include "sequenceFile.hpp"
+
+int main(int argc, char *argv[])
+{
+  // Parsing command line arguments
+  argparse::ArgumentParser program("sequenceConverter", "1.0");
+
+  program.add_argument("inputFile")
+    .help("Path to the sequence file to convert, either text (.sol) or binary.")
+    .required();
+
+  program.add_argument("outputFile")
+    .help("Path to write the converted sequence to.")
+    .required();
+
+  program.add_argument("--format")
+    .help("Output format. Possible values: 'Text', 'Binary'. By default, the opposite of the input's format.")
+    .default_value(std::string(""));
+
+  // Try to parse arguments
+  try { program.parse_args(argc, argv); } catch (const std::runtime_error &err) { JAFFAR_THROW_LOGIC("%s\n%s", err.what(), program.help().str().c_str()); }
+
+  const auto inputFilePath = program.get<std::string>("inputFile");
+  const auto outputFilePath = program.get<std::string>("outputFile");
+  auto format = program.get<std::string>("--format");
+
+  // The input parser takes no settings for now
+  const jaffar::InputParser inputParser(nlohmann::json::object());
+
+  // Loading sequence
+  const auto sequence = jaffar::sequenceFile::load(inputFilePath, inputParser);
+
+  // Determining output format
+  if (format == "")
+  {
+    const jaffar::sequenceFile::MappedFile inputFile(inputFilePath);
+    format = jaffar::sequenceFile::isBinary(inputFile.getData(), inputFile.getSize()) ? "Text" : "Binary";
+  }
+
+  bool status = false;
+  if (format == "Text") status = jaffar::sequenceFile::saveText(outputFilePath, sequence, inputParser);
+  else if (format == "Binary") status = jaffar::sequenceFile::saveBinary(outputFilePath, sequence);
+  else JAFFAR_THROW_LOGIC("Unrecognized output format: %s\n", format.c_str());
+
+  if (status == false) JAFFAR_THROW_RUNTIME("Could not write sequence file: %s\n", outputFilePath.c_str());
+
+  printf("[] Converted %lu inputs: '%s' -> '%s' (%s)\n", sequence.size(), inputFilePath.c_str(), outputFilePath.c_str(), format.c_str());
+
+  return 0;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+// Input sequence files
+// Sequences are either text (.sol), one input string per line, or binary: a fixed header followed by
+// fixed-size records. Both are read through a read-only memory mapping, and text lines are parsed in place,
+// so loading a sequence allocates nothing beyond the decoded inputs.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <jaffarCommon/exceptions.hpp>
+#include "inputParser.hpp"
+
+namespace jaffar
+{
+
+namespace sequenceFile
+{
+
+#define _SEQUENCE_FILE_MAGIC "JPSPSEQ"
+#define _SEQUENCE_FILE_VERSION 2
+
+struct header_t
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  uint64_t recordCount;
+};
+
+// Button mask (same bit layout as input_t), followed by the analog axes at full 16-bit range
+struct record_t
+{
+  uint16_t buttons;
+  int16_t analogs[4];
+};
+
+inline record_t packInput(const input_t &input)
+{
+  record_t record;
+  record.buttons = input.buttons;
+  for (uint8_t i = 0; i < 4; i++) record.analogs[i] = input.getAnalog((analog_t)i);
+  return record;
+}
+
+inline input_t unpackInput(const record_t &record)
+{
+  input_t input;
+  input.buttons = record.buttons;
+  for (uint8_t i = 0; i < 4; i++) input.setAnalog((analog_t)i, record.analogs[i]);
+  return input;
+}
+
+inline bool isBinary(const uint8_t *data, const size_t size) { return size >= sizeof(header_t) && memcmp(data, _SEQUENCE_FILE_MAGIC, sizeof(header_t::magic)) == 0; }
+
+// Read-only mapping of a whole file
+class MappedFile
+{
+  public:
+
+  MappedFile(const std::string &filePath)
+  {
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd < 0) JAFFAR_THROW_LOGIC("[ERROR] Could not find or read from input sequence file: %s\n", filePath.c_str());
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0) { close(fd); JAFFAR_THROW_LOGIC("[ERROR] Could not find or read from input sequence file: %s\n", filePath.c_str()); }
+    _size = fileStat.st_size;
+
+    if (_size > 0)
+    {
+      auto data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) { close(fd); JAFFAR_THROW_LOGIC("[ERROR] Could not map input sequence file: %s\n", filePath.c_str()); }
+      _data = (const uint8_t *)data;
+    }
+
+    close(fd);
+  }
+
+  ~MappedFile() { if (_data != nullptr) munmap((void *)_data, _size); }
+
+  const uint8_t *getData() const { return _data; }
+  size_t getSize() const { return _size; }
+
+  private:
+
+  const uint8_t *_data = nullptr;
+  size_t _size = 0;
+};
+
+// Loads a text or binary sequence, recognized by its contents
+inline std::vector<input_t> load(const std::string &filePath, const InputParser &inputParser)
+{
+  const MappedFile file(filePath);
+  const auto data = file.getData();
+  const auto size = file.getSize();
+  std::vector<input_t> sequence;
+
+  if (isBinary(data, size))
+  {
+    header_t header;
+    memcpy(&header, data, sizeof(header_t));
+    if (header.version != _SEQUENCE_FILE_VERSION) JAFFAR_THROW_LOGIC("Unsupported binary sequence version: %u\n", header.version);
+    if (header.recordSize != sizeof(record_t)) JAFFAR_THROW_LOGIC("Unsupported binary sequence record size: %u\n", header.recordSize);
+    if (header.recordCount > (size - sizeof(header_t)) / sizeof(record_t)) JAFFAR_THROW_LOGIC("Truncated binary sequence file: %s\n", filePath.c_str());
+
+    const auto records = (const record_t *)&data[sizeof(header_t)];
+    sequence.resize(header.recordCount);
+    for (size_t i = 0; i < header.recordCount; i++) sequence[i] = unpackInput(records[i]);
+    return sequence;
+  }
+
+  // Parsing text lines in place. Empty lines (e.g., the one after the last newline) are skipped
+  const std::string_view text((const char *)data, size);
+  size_t lineStart = 0;
+  while (lineStart < text.size())
+  {
+    size_t lineEnd = text.find('\n', lineStart);
+    if (lineEnd == std::string_view::npos) lineEnd = text.size();
+
+    auto line = text.substr(lineStart, lineEnd - lineStart);
+    if (line.empty() == false && line.back() == '\r') line.remove_suffix(1);
+    if (line.empty() == false) sequence.push_back(inputParser.parseInputString(line));
+
+    lineStart = lineEnd + 1;
+  }
+
+  return sequence;
+}
+
+inline bool saveBinary(const std::string &filePath, const std::vector<input_t> &sequence)
+{
+  auto file = fopen(filePath.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  header_t header;
+  memset(&header, 0, sizeof(header_t));
+  memcpy(header.magic, _SEQUENCE_FILE_MAGIC, sizeof(header.magic));
+  header.version = _SEQUENCE_FILE_VERSION;
+  header.recordSize = sizeof(record_t);
+  header.recordCount = sequence.size();
+
+  std::vector<record_t> records(sequence.size());
+  for (size_t i = 0; i < sequence.size(); i++) records[i] = packInput(sequence[i]);
+
+  bool status = fwrite(&header, sizeof(header_t), 1, file) == 1;
+  status = status && fwrite(records.data(), sizeof(record_t), records.size(), file) == records.size();
+  fclose(file);
+  return status;
+}
+
+inline bool saveText(const std::string &filePath, const std::vector<input_t> &sequence, const InputParser &inputParser)
+{
+  auto file = fopen(filePath.c_str(), "w");
+  if (file == nullptr) return false;
+
+  bool status = true;
+  for (const auto &input : sequence) status = status && fprintf(file, "%s\n", inputParser.inputToString(input).c_str()) > 0;
+  fclose(file);
+  return status;
+}
+
+} // namespace sequenceFile
+
+} // namespace jaffar
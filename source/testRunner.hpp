@@ -0,0 +1,412 @@
+#pragma once
+
+// Test runner
+// Reproduces an input sequence on an already initialized emulator instance, timing it and reporting its results.
+// The tester boots a fresh instance for a single run, while the batch tester's zygote mode boots one per script and
+// runs each job on a forked copy of it.
+
+#include <jaffarCommon/json.hpp>
+#include <jaffarCommon/serializers/contiguous.hpp>
+#include <jaffarCommon/deserializers/contiguous.hpp>
+#include <jaffarCommon/hash.hpp>
+#include <jaffarCommon/timing.hpp>
+#include <jaffarCommon/file.hpp>
+#include <jaffarCommon/exceptions.hpp>
+#include "emuInstance.hpp"
+#include "sequenceFile.hpp"
+#include "latencyHistogram.hpp"
+#include <array>
+#include <chrono>
+#include <unordered_set>
+#include <vector>
+#include <string>
+
+namespace jaffar
+{
+
+namespace testRunner
+{
+
+// Number of branches explored per input by the 'Branch' cycle type, unless specified
+#define _DEFAULT_BRANCH_FACTOR 4
+
+struct options_t
+{
+  std::string scriptFilePath;
+  std::string sequenceFilePath;
+  std::string cycleType = "Simple";
+  size_t branchFactor = _DEFAULT_BRANCH_FACTOR;
+  std::string branchInputFilePath;
+  bool useWarmUp = false;
+  bool useIncrementalHash = false;
+  bool useIncrementalRestore = false;
+  std::string hashOutputFile;
+  std::string resultOutputFile;
+  std::string phaseTimingOutputFile;
+  std::string telemetryOutputFile;
+  bool useTelemetryChecksums = false;
+  std::string avHashOutputFile;
+};
+
+inline bool isCycleTypeRecognized(const std::string &cycleType)
+{
+  return cycleType == "Simple" || cycleType == "Rerecord" || cycleType == "Full" || cycleType == "Branch";
+}
+
+// Checks the rom, boots the emulator and brings it to the script's initial state
+inline void initializeEmulator(EmuInstance &e, const nlohmann::json &configJs)
+{
+  // Getting initial state file path
+  const auto initialStateFilePath = jaffarCommon::json::getString(configJs, "Initial State File");
+
+  // Getting expected Rom SHA1 hash
+  const auto expectedRomSHA1 = jaffarCommon::json::getString(configJs, "Expected Rom SHA1");
+
+  // Calculating Rom SHA1 over the mapped rom image
+  const auto romSHA1 = e.getRomSHA1();
+
+  // Checking with the expected SHA1 hash
+  if (romSHA1 != expectedRomSHA1) JAFFAR_THROW_LOGIC("Wrong Rom SHA1. Found: '%s', Expected: '%s'\n", romSHA1.c_str(), expectedRomSHA1.c_str());
+
+  // Initializing emulator instance
+  if (e.initialize() == false) JAFFAR_THROW_LOGIC("Error initializing emulator\n");
+
+  // If an initial state is provided, load it now
+  if (initialStateFilePath != "")
+  {
+    std::string stateFileData;
+    if (jaffarCommon::file::loadStringFromFile(stateFileData, initialStateFilePath) == false) JAFFAR_THROW_LOGIC("Could not initial state file: %s\n", initialStateFilePath.c_str());
+    jaffarCommon::deserializer::Contiguous d(stateFileData.data());
+    e.deserializeState(d);
+  }
+
+  // Disabling requested blocks from state serialization
+  for (const auto& block : jaffarCommon::json::getArray<std::string>(configJs, "Disable State Blocks")) e.disableStateBlock(block);
+
+  // Disable rendering
+  e.disableRendering();
+}
+
+// Runs the sequence from the emulator's current state, printing and saving the results as requested
+inline void run(EmuInstance &e, const nlohmann::json &configJs, const options_t &options)
+{
+  const auto &scriptFilePath = options.scriptFilePath;
+  const auto &sequenceFilePath = options.sequenceFilePath;
+  const auto &cycleType = options.cycleType;
+  const auto branchFactor = options.branchFactor;
+  const auto &branchInputFilePath = options.branchInputFilePath;
+  const auto useWarmUp = options.useWarmUp;
+  const auto useIncrementalHash = options.useIncrementalHash;
+  const auto useIncrementalRestore = options.useIncrementalRestore;
+  const auto &hashOutputFile = options.hashOutputFile;
+  const auto &resultOutputFile = options.resultOutputFile;
+  const auto &phaseTimingOutputFile = options.phaseTimingOutputFile;
+  const auto &telemetryOutputFile = options.telemetryOutputFile;
+  const auto useTelemetryChecksums = options.useTelemetryChecksums;
+  const auto &avHashOutputFile = options.avHashOutputFile;
+
+  // Getting rom file path and hash
+  const auto romFilePath = jaffarCommon::json::getString(configJs, "Rom File Path");
+  const auto romSHA1 = e.getRomSHA1();
+
+  // Listing disabled blocks in lite state serialization
+  std::string stateDisabledBlocksOutput;
+  for (const auto& entry : jaffarCommon::json::getArray<std::string>(configJs, "Disable State Blocks")) stateDisabledBlocksOutput += entry + std::string(" ");
+
+  // Listing core options
+  std::string coreOptionsOutput;
+  for (const auto& option : e.getCoreOptions()) coreOptionsOutput += option.first + std::string("=") + option.second + std::string(" ");
+
+  // Getting Controller types
+  const auto controller1Type = jaffarCommon::json::getString(configJs, "Controller 1 Type");
+  const auto controller2Type = jaffarCommon::json::getString(configJs, "Controller 1 Type");
+
+  // Enabling incremental hashing, if requested
+  bool isIncrementalHashEnabled = false;
+  if (useIncrementalHash == true) isIncrementalHashEnabled = e.enableIncrementalHashing();
+
+  // Enabling incremental restore, if requested
+  bool isIncrementalRestoreEnabled = false;
+  if (useIncrementalRestore == true) isIncrementalRestoreEnabled = e.enableIncrementalRestore();
+
+  // Getting full state size
+  const auto stateSize = e.getStateSize();
+
+  // Getting input parser from the emulator
+  const auto inputParser = e.getInputParser();
+
+  // Loading and decoding the sequence file (text or binary)
+  const auto decodedSequence = jaffar::sequenceFile::load(sequenceFilePath, *inputParser);
+
+  // Getting sequence lenght
+  const auto sequenceLength = decodedSequence.size();
+
+  // Building the branch alphabet: either the inputs of the given file, or the distinct inputs of the sequence in order of appearance
+  std::vector<jaffar::input_t> branchAlphabet;
+  if (cycleType == "Branch")
+  {
+    if (branchInputFilePath != "") branchAlphabet = jaffar::sequenceFile::load(branchInputFilePath, *inputParser);
+    else
+    {
+      std::unordered_set<jaffar::input_t> seenInputs;
+      for (const auto &input : decodedSequence) if (seenInputs.insert(input).second == true) branchAlphabet.push_back(input);
+    }
+    if (branchAlphabet.empty()) JAFFAR_THROW_LOGIC("The branch input alphabet is empty\n");
+  }
+
+  // Getting emulation core name
+  std::string emulationCoreName = e.getCoreName();
+
+  // Printing test information
+  printf("[] -----------------------------------------\n");
+  printf("[] Running Script:                         '%s'\n", scriptFilePath.c_str());
+  printf("[] Cycle Type:                             '%s'\n", cycleType.c_str());
+  printf("[] Emulation Core:                         '%s'\n", emulationCoreName.c_str());
+  printf("[] Rom File:                               '%s'\n", romFilePath.c_str());
+  printf("[] Controller Types:                       '%s' : '%s'\n", controller1Type.c_str(), controller2Type.c_str());
+  printf("[] Rom Hash:                               'SHA1: %s'%s\n", romSHA1.c_str(), e.isRomSHA1Cached() ? " (cached)" : "");
+  printf("[] Core Options:                           [ %s ]\n", coreOptionsOutput.c_str());
+  printf("[] Rom Format:                             '%s'\n", e.getRomFormat().c_str());
+  printf("[] Sequence File:                          '%s'\n", sequenceFilePath.c_str());
+  printf("[] Sequence Length:                        %lu\n", sequenceLength);
+  if (cycleType == "Branch") printf("[] Branch Factor:                          %lu - Alphabet Size: %lu inputs\n", branchFactor, branchAlphabet.size());
+  printf("[] State Size:                             %lu bytes - Disabled Blocks:  [ %s ]\n", stateSize, stateDisabledBlocksOutput.c_str());
+  if (useIncrementalHash) printf("[] Incremental Hash:                       %s\n", isIncrementalHashEnabled ? "Enabled" : "Unavailable (no soft-dirty page tracking), using full hash");
+  if (useIncrementalRestore) printf("[] Incremental Restore:                    %s\n", isIncrementalRestoreEnabled ? "Enabled" : "Unavailable (no soft-dirty page tracking), using full restore");
+  
+  // If warmup is enabled, run it now. This helps in reducing variation in performance results due to CPU throttling
+  if (useWarmUp)
+  {
+    printf("[] ********** Warming Up **********\n");
+
+    auto tw = jaffarCommon::timing::now();
+    double waitedTime = 0.0;
+    #pragma omp parallel
+    while(waitedTime < 2.0) waitedTime = jaffarCommon::timing::timeDeltaSeconds(jaffarCommon::timing::now(), tw);
+  }
+
+  // Starting telemetry recording, if requested (with room for every advance performed per input)
+  const size_t advancesPerInput = cycleType == "Simple" ? 1 : 2 + (cycleType == "Branch" ? branchFactor : 0);
+  jaffar::telemetry::initialize(telemetryOutputFile != "" ? advancesPerInput * sequenceLength : 0);
+  jaffar::telemetry::setChecksumsEnabled(useTelemetryChecksums);
+
+  // Collecting per-input video and audio digests, if requested. They are kept in memory and written after the run,
+  // so that writing them does not count towards the measured time
+  std::vector<std::array<jaffarCommon::hash::hash_t, 2>> avDigests;
+  if (avHashOutputFile != "")
+  {
+    avDigests.reserve(sequenceLength);
+    e.enableAVHashing();
+  }
+
+  printf("[] ********** Running Test **********\n");
+
+  fflush(stdout);
+
+  // Serializing initial state
+  auto currentState = (uint8_t *)malloc(stateSize);
+  {
+    jaffarCommon::serializer::Contiguous cs(currentState);
+    e.serializeState(cs);
+  }
+
+  // Storage for the state reached by each branch
+  auto branchState = (uint8_t *)malloc(stateSize);
+
+  // Check whether to perform each action
+  bool doPreAdvance = cycleType == "Rerecord";
+  bool doDeserialize = cycleType == "Rerecord" || cycleType == "Full" || cycleType == "Branch";
+  bool doSerialize = cycleType == "Rerecord" || cycleType == "Full" || cycleType == "Branch";
+  bool doPostAdvance = cycleType == "Full";
+  bool doBranch = cycleType == "Branch";
+
+  // Per-phase latency histograms and, if requested, per-input phase timings (in nanoseconds)
+  // Branch times cover a whole load/advance/save of each branch, and add up over the branches of an input
+  enum phase_t { preAdvancePhase = 0, branchPhase, deserializePhase, advancePhase, serializePhase, postAdvancePhase, hashPhase, phaseCount };
+  const char *phaseNames[phaseCount] = { "Pre-Advance", "Branch", "Deserialize", "Advance", "Serialize", "Post-Advance", "Hash" };
+  std::array<jaffar::LatencyHistogram, phaseCount> phaseHistograms;
+  std::vector<std::array<uint64_t, phaseCount>> phaseTimings(phaseTimingOutputFile != "" ? sequenceLength : 0, std::array<uint64_t, phaseCount>{});
+
+  // Runs a phase of the current cycle, timing it
+  const auto runPhase = [&](const phase_t phase, const size_t inputId, const auto &operation)
+  {
+    const auto tp0 = std::chrono::steady_clock::now();
+    operation();
+    const uint64_t phaseTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - tp0).count();
+    phaseHistograms[phase].record(phaseTime);
+    if (phaseTimings.empty() == false) phaseTimings[inputId][phase] += phaseTime;
+  };
+
+  // Position within the branch alphabet, so that consecutive branches cycle through all of it
+  size_t branchInputId = 0;
+
+  // Actually running the sequence
+  auto t0 = std::chrono::high_resolution_clock::now();
+  for (size_t inputId = 0; inputId < decodedSequence.size(); inputId++)
+  {
+    const auto &input = decodedSequence[inputId];
+
+    if (doPreAdvance == true) runPhase(preAdvancePhase, inputId, [&]() { e.advanceState(input); });
+
+    if (doBranch == true) for (size_t branchId = 0; branchId < branchFactor; branchId++) runPhase(branchPhase, inputId, [&]()
+    {
+      jaffarCommon::deserializer::Contiguous d(currentState, stateSize);
+      e.deserializeState(d);
+      e.advanceState(branchAlphabet[branchInputId]);
+      branchInputId = branchInputId + 1 == branchAlphabet.size() ? 0 : branchInputId + 1;
+      auto s = jaffarCommon::serializer::Contiguous(branchState, stateSize);
+      e.serializeState(s);
+    });
+
+    if (doDeserialize == true) runPhase(deserializePhase, inputId, [&]()
+    {
+      jaffarCommon::deserializer::Contiguous d(currentState, stateSize);
+      e.deserializeState(d);
+    });
+
+    runPhase(advancePhase, inputId, [&]() { e.advanceState(input); });
+
+    if (doSerialize == true) runPhase(serializePhase, inputId, [&]()
+    {
+      auto s = jaffarCommon::serializer::Contiguous(currentState, stateSize);
+      e.serializeState(s);
+    });
+
+    if (doPostAdvance == true) runPhase(postAdvancePhase, inputId, [&]() { e.advanceState(input); });
+
+    if (useIncrementalHash == true) runPhase(hashPhase, inputId, [&]() { e.getStateHash(); });
+
+    if (avHashOutputFile != "") avDigests.push_back({ e.getVideoDigest(), e.getAudioDigest() });
+  }
+  auto tf = std::chrono::high_resolution_clock::now();
+
+  // The post-advance goes beyond the last saved state, so going back to it for the final hash to match the other cycle types
+  if (doPostAdvance == true)
+  {
+    jaffarCommon::deserializer::Contiguous d(currentState, stateSize);
+    e.deserializeState(d);
+  }
+
+  // Calculating running time
+  auto dt = std::chrono::duration_cast<std::chrono::nanoseconds>(tf - t0).count();
+  double elapsedTimeSeconds = (double)dt * 1.0e-9;
+
+  // Calculating final state hash
+  auto result = e.getStateHash();
+
+  // Measuring a full hash as baseline for the incremental one, and making sure both agree
+  double fullHashTimeSeconds = 0.0;
+  if (useIncrementalHash == true)
+  {
+    auto th0 = std::chrono::high_resolution_clock::now();
+    auto fullResult = e.getFullStateHash();
+    auto thf = std::chrono::high_resolution_clock::now();
+    fullHashTimeSeconds = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(thf - th0).count() * 1.0e-9;
+    if (fullResult != result) JAFFAR_THROW_RUNTIME("Incremental state hash (0x%lX%lX) does not match the full state hash (0x%lX%lX)\n", result.first, result.second, fullResult.first, fullResult.second);
+  }
+
+  // Creating hash string
+  char hashStringBuffer[256];
+  sprintf(hashStringBuffer, "0x%lX%lX", result.first, result.second);
+
+  // Printing time information
+  printf("[] Elapsed time:                           %3.3fs\n", (double)dt * 1.0e-9);
+  printf("[] Performance:                            %.3f inputs / s\n", (double)sequenceLength / elapsedTimeSeconds);
+  if (doBranch == true) printf("[] Branch Performance:                     %.3f branches / s\n", (double)(sequenceLength * branchFactor) / elapsedTimeSeconds);
+  printf("[] Final State Hash:                       %s\n", hashStringBuffer);
+  if (useIncrementalHash == true)
+  {
+    const double averageHashTimeSeconds = phaseHistograms[hashPhase].getMean() * 1.0e-9;
+    printf("[] Average Hash Time:                      %.3fus\n", averageHashTimeSeconds * 1.0e6);
+    printf("[] Full Hash Time:                         %.3fus\n", fullHashTimeSeconds * 1.0e6);
+    printf("[] Incremental Hash Speedup:               %.2fx\n", fullHashTimeSeconds / averageHashTimeSeconds);
+  }
+  
+  // Printing per-phase latencies, for the phases that ran
+  for (size_t i = 0; i < phaseCount; i++)
+  {
+    const auto &h = phaseHistograms[i];
+    if (h.getCount() == 0) continue;
+    const auto label = std::string(phaseNames[i]) + " Latency:";
+    printf("[] %-40s min %9.3fus | p50 %9.3fus | p99 %9.3fus | max %9.3fus\n", label.c_str(), h.getMin() * 1.0e-3, h.getPercentile(0.50) * 1.0e-3, h.getPercentile(0.99) * 1.0e-3, h.getMax() * 1.0e-3);
+  }
+
+  // If saving per-input phase timings, do it now
+  if (phaseTimingOutputFile != "")
+  {
+    auto phaseTimingFile = fopen(phaseTimingOutputFile.c_str(), "w");
+    if (phaseTimingFile == nullptr) JAFFAR_THROW_RUNTIME("Could not write phase timing file: %s\n", phaseTimingOutputFile.c_str());
+    fprintf(phaseTimingFile, "Input");
+    for (size_t i = 0; i < phaseCount; i++) fprintf(phaseTimingFile, ",%s (ns)", phaseNames[i]);
+    fprintf(phaseTimingFile, "\n");
+    for (size_t inputId = 0; inputId < phaseTimings.size(); inputId++)
+    {
+      fprintf(phaseTimingFile, "%lu", inputId);
+      for (size_t i = 0; i < phaseCount; i++) fprintf(phaseTimingFile, ",%lu", phaseTimings[inputId][i]);
+      fprintf(phaseTimingFile, "\n");
+    }
+    fclose(phaseTimingFile);
+  }
+
+  // If saving per-input video and audio digests, do it now
+  if (avHashOutputFile != "")
+  {
+    auto avHashFile = fopen(avHashOutputFile.c_str(), "w");
+    if (avHashFile == nullptr) JAFFAR_THROW_RUNTIME("Could not write video/audio digest file: %s\n", avHashOutputFile.c_str());
+    fprintf(avHashFile, "Input,Video Digest,Audio Digest\n");
+    for (size_t inputId = 0; inputId < avDigests.size(); inputId++)
+    {
+      const auto &videoDigest = avDigests[inputId][0];
+      const auto &audioDigest = avDigests[inputId][1];
+      fprintf(avHashFile, "%lu,0x%016lX%016lX,0x%016lX%016lX\n", inputId, videoDigest.first, videoDigest.second, audioDigest.first, audioDigest.second);
+    }
+    fclose(avHashFile);
+  }
+
+  // If saving hash, do it now
+  if (hashOutputFile != "") jaffarCommon::file::saveStringToFile(std::string(hashStringBuffer), hashOutputFile.c_str());
+
+  // If saving results, do it now
+  if (resultOutputFile != "")
+  {
+    nlohmann::json results;
+    results["Script File"] = scriptFilePath;
+    results["Sequence File"] = sequenceFilePath;
+    results["Cycle Type"] = cycleType;
+    results["Core Options"] = e.getCoreOptions();
+    results["Sequence Length"] = sequenceLength;
+    results["State Size"] = stateSize;
+    results["Elapsed Time"] = elapsedTimeSeconds;
+    results["Inputs Per Second"] = (double)sequenceLength / elapsedTimeSeconds;
+    results["Final State Hash"] = std::string(hashStringBuffer);
+    if (doBranch == true)
+    {
+      results["Branch Factor"] = branchFactor;
+      results["Branch Alphabet Size"] = branchAlphabet.size();
+      results["Branches Per Second"] = (double)(sequenceLength * branchFactor) / elapsedTimeSeconds;
+    }
+    for (size_t i = 0; i < phaseCount; i++)
+    {
+      const auto &h = phaseHistograms[i];
+      if (h.getCount() == 0) continue;
+      auto &phaseResults = results["Phase Latencies"][phaseNames[i]];
+      phaseResults["Min"] = h.getMin();
+      phaseResults["P50"] = h.getPercentile(0.50);
+      phaseResults["P99"] = h.getPercentile(0.99);
+      phaseResults["Max"] = h.getMax();
+    }
+    if (jaffarCommon::file::saveStringToFile(results.dump(2), resultOutputFile.c_str()) == false) JAFFAR_THROW_RUNTIME("Could not write results file: %s\n", resultOutputFile.c_str());
+  }
+
+  // If saving telemetry, do it now
+  if (telemetryOutputFile != "")
+  {
+    const bool isCSV = telemetryOutputFile.size() >= 4 && telemetryOutputFile.substr(telemetryOutputFile.size() - 4) == ".csv";
+    const bool status = isCSV ? jaffar::telemetry::dumpCSV(telemetryOutputFile) : jaffar::telemetry::dumpBinary(telemetryOutputFile);
+    if (status == false) JAFFAR_THROW_RUNTIME("Could not write telemetry file: %s\n", telemetryOutputFile.c_str());
+  }
+}
+
+} // namespace testRunner
+
+} // namespace jaffar
@@ -1,18 +1,127 @@
 #include "argparse/argparse.hpp"
 #include <jaffarCommon/json.hpp>
-#include <jaffarCommon/serializers/contiguous.hpp>
-#include <jaffarCommon/deserializers/contiguous.hpp>
-#include <jaffarCommon/hash.hpp>
-#include <jaffarCommon/string.hpp>
-#include <jaffarCommon/timing.hpp>
 #include <jaffarCommon/logger.hpp>
 #include <jaffarCommon/file.hpp>
 #include "emuInstance.hpp"
-#include <chrono>
-#include <sstream>
-#include <vector>
+#include "testRunner.hpp"
+#include "argumentParser.hpp"
+#include <filesystem>
+#include <functional>
 #include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// A variant of the test run, compared against the others
+struct runVariant_t
+{
+  std::string name;
+
+  // Applies the variant to a new emulator instance, before it is initialized, and to the run options
+  std::function<void(jaffar::EmuInstance &, jaffar::testRunner::options_t &)> setup;
+};
+
+// Core option selecting the CPU core, and its values compared by '--compareCpuCores'
+#define _CPU_CORE_OPTION "ppsspp_cpu_core"
+static const std::vector<std::string> _cpuCores = { "Interpreter", "IR JIT", "JIT" };
+
+// Runs the sequence under each variant, reporting their throughput and whether their final state hashes agree.
+// The emulator core is process-wide and can only be booted once, so each run takes place in its own child process
+static int compareRuns(const std::string &title, const std::string &resultsKey, const std::vector<runVariant_t> &variants, const nlohmann::json &configJs, const jaffar::testRunner::options_t &options, const std::string &romHashCacheDirectory)
+{
+  nlohmann::json variantResults;
+  std::string referenceHash;
+  bool allSucceeded = true;
+  bool hashesAgree = true;
+
+  for (size_t i = 0; i < variants.size(); i++)
+  {
+    const auto &variant = variants[i];
+
+    // Each run reports its results through a temporary file
+    auto runOptions = options;
+    runOptions.resultOutputFile = (std::filesystem::temp_directory_path() / ("tester." + std::to_string(getpid()) + "." + std::to_string(i) + ".json")).string();
 
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0) JAFFAR_THROW_RUNTIME("Could not fork process for run '%s'\n", variant.name.c_str());
+    if (pid == 0)
+    {
+      try
+      {
+        auto e = jaffar::EmuInstance(configJs);
+        e.setRomHashCacheDirectory(romHashCacheDirectory);
+        variant.setup(e, runOptions);
+        jaffar::testRunner::initializeEmulator(e, configJs);
+        jaffar::testRunner::run(e, configJs, runOptions);
+        e.finalize();
+      }
+      catch (const std::exception &err)
+      {
+        fprintf(stderr, "%s", err.what());
+        fflush(stdout);
+        _exit(1);
+      }
+      fflush(stdout);
+      _exit(0);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) JAFFAR_THROW_RUNTIME("Error waiting for run '%s' process\n", variant.name.c_str());
+
+    std::string runResultsRaw;
+    const bool succeeded = WIFEXITED(status) && WEXITSTATUS(status) == 0 && jaffarCommon::file::loadStringFromFile(runResultsRaw, runOptions.resultOutputFile);
+    std::filesystem::remove(runOptions.resultOutputFile);
+
+    nlohmann::json result;
+    result["Status"] = succeeded ? "Passed" : "Failed";
+    if (succeeded == true)
+    {
+      const auto runResults = nlohmann::json::parse(runResultsRaw);
+      const auto finalHash = jaffarCommon::json::getString(runResults, "Final State Hash");
+      result["Inputs Per Second"] = jaffarCommon::json::getNumber<double>(runResults, "Inputs Per Second");
+      result["Final State Hash"] = finalHash;
+      if (referenceHash == "") referenceHash = finalHash;
+      if (finalHash != referenceHash) hashesAgree = false;
+    }
+    else allSucceeded = false;
+    variantResults[variant.name] = result;
+  }
+
+  // Measuring each run's speedup against the first one, the reference
+  const auto &referenceResult = variantResults[variants[0].name];
+  const double referenceInputsPerSecond = referenceResult.contains("Inputs Per Second") ? jaffarCommon::json::getNumber<double>(referenceResult, "Inputs Per Second") : 0.0;
+  if (referenceInputsPerSecond > 0.0) for (auto &entry : variantResults.items())
+    if (entry.value().contains("Inputs Per Second")) entry.value()["Speedup"] = jaffarCommon::json::getNumber<double>(entry.value(), "Inputs Per Second") / referenceInputsPerSecond;
+
+  // Printing comparison
+  printf("[] ********** %s **********\n", title.c_str());
+  for (const auto &variant : variants)
+  {
+    const auto &result = variantResults[variant.name];
+    const auto label = std::string("'") + variant.name + std::string("':");
+    if (jaffarCommon::json::getString(result, "Status") != "Passed") { printf("[] %-40s Failed\n", label.c_str()); continue; }
+    const auto inputsPerSecond = jaffarCommon::json::getNumber<double>(result, "Inputs Per Second");
+    const auto finalHash = jaffarCommon::json::getString(result, "Final State Hash");
+    if (result.contains("Speedup")) printf("[] %-40s %.3f inputs / s (%.2fx) - %s\n", label.c_str(), inputsPerSecond, jaffarCommon::json::getNumber<double>(result, "Speedup"), finalHash.c_str());
+    else printf("[] %-40s %.3f inputs / s - %s\n", label.c_str(), inputsPerSecond, finalHash.c_str());
+  }
+  printf("[] Final State Hashes:                     %s\n", hashesAgree ? "Agree" : "Differ");
+
+  // If saving results, do it now
+  if (options.resultOutputFile != "")
+  {
+    nlohmann::json results;
+    results["Script File"] = options.scriptFilePath;
+    results["Sequence File"] = options.sequenceFilePath;
+    results["Cycle Type"] = options.cycleType;
+    results[resultsKey] = variantResults;
+    results["Hashes Agree"] = hashesAgree;
+    if (jaffarCommon::file::saveStringToFile(results.dump(2), options.resultOutputFile.c_str()) == false) JAFFAR_THROW_RUNTIME("Could not write results file: %s\n", options.resultOutputFile.c_str());
+  }
+
+  return allSucceeded == true && hashesAgree == true ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {
@@ -24,17 +133,69 @@ int main(int argc, char *argv[])
     .required();
 
   program.add_argument("sequenceFile")
-    .help("Path to the input sequence file (.sol) to reproduce.")
+    .help("Path to the input sequence file to reproduce, either text (.sol) or binary.")
     .required();
 
   program.add_argument("--cycleType")
-    .help("Specifies the emulation actions to be performed per each input. Possible values: 'Simple': performs only advance state, 'Rerecord': performs load/advance/save, and 'Full': performs load/advance/save/advance.")
+    .help("Specifies the emulation actions to be performed per each input. Possible values: 'Simple': performs only advance state, 'Rerecord': performs advance/load/advance/save, 'Full': performs load/advance/save/advance, and 'Branch': loads the current state and advances it with each of '--branchFactor' inputs from the branch alphabet, saving every branch, before advancing the sequence with load/advance/save.")
     .default_value(std::string("Simple"));
 
+  program.add_argument("--branchFactor")
+    .help("Number of branches explored from the current state per input, for the 'Branch' cycle type.")
+    .default_value(std::to_string(_DEFAULT_BRANCH_FACTOR));
+
+  program.add_argument("--branchInputFile")
+    .help("Path to a sequence file (text or binary) whose inputs form the alphabet used for branching. By default, the distinct inputs of the sequence file are used.")
+    .default_value(std::string(""));
+
   program.add_argument("--hashOutputFile")
     .help("Path to write the hash output to.")
     .default_value(std::string(""));
 
+  program.add_argument("--resultOutputFile")
+    .help("Path to write the test results to, as JSON.")
+    .default_value(std::string(""));
+
+  program.add_argument("--phaseTimingOutputFile")
+    .help("Path to write the time taken by each phase (pre-advance, deserialize, advance, serialize, hash) of every input to, as CSV.")
+    .default_value(std::string(""));
+
+  program.add_argument("--incrementalHash")
+  .help("Hashes the state after every input, rehashing only the memory pages written since the previous hash, and reports its speedup against a full hash")
+  .default_value(false)
+  .implicit_value(true);
+
+  program.add_argument("--incrementalRestore")
+  .help("Restores the last saved state by copying back only the memory pages written since it was taken")
+  .default_value(false)
+  .implicit_value(true);
+
+  program.add_argument("--telemetryOutputFile")
+    .help("Path to write the per-frame telemetry trace to (requires building with 'enableTelemetry'). Files ending in '.csv' are written as CSV, otherwise as binary records.")
+    .default_value(std::string(""));
+
+  program.add_argument("--telemetryChecksums")
+  .help("Includes video and audio checksums in the telemetry trace")
+  .default_value(false)
+  .implicit_value(true);
+
+  program.add_argument("--avHashOutputFile")
+    .help("Path to write the per-input video and audio digests to, as CSV.")
+    .default_value(std::string(""));
+
+  program.add_argument("--romHashCacheDirectory")
+    .help("Directory to keep rom image hashes in across runs, so that an unchanged image is not hashed again.")
+    .default_value(std::string(""));
+
+  program.add_argument("--logLevel")
+    .help("Minimum level of the core log messages to print. Possible values: 'Debug', 'Info', 'Warn', 'Error'.")
+    .default_value(std::string("Warn"));
+
+  program.add_argument("--compareCpuCores")
+  .help("Runs the sequence once under each CPU core (interpreter, IR interpreter and JIT), each in its own process, and reports their performance and whether their final state hashes agree")
+  .default_value(false)
+  .implicit_value(true);
+
   program.add_argument("--warmup")
   .help("Warms up the CPU before running for reduced variation in performance results")
   .default_value(false)
@@ -43,186 +204,97 @@ int main(int argc, char *argv[])
   // Try to parse arguments
   try { program.parse_args(argc, argv); } catch (const std::runtime_error &err) { JAFFAR_THROW_LOGIC("%s\n%s", err.what(), program.help().str().c_str()); }
 
-  // Getting test script file path
-  const auto scriptFilePath = program.get<std::string>("scriptFile");
-
-  // Getting path where to save the hash output (if any)
-  const auto hashOutputFile = program.get<std::string>("--hashOutputFile");
-
-  // Getting cycle type
-  const auto cycleType = program.get<std::string>("--cycleType");
+  // Test settings
+  jaffar::testRunner::options_t options;
 
-  bool cycleTypeRecognized = false;
-  if (cycleType == "Simple") cycleTypeRecognized = true;
-  if (cycleType == "Rerecord") cycleTypeRecognized = true;
-  if (cycleTypeRecognized == false) JAFFAR_THROW_LOGIC("Unrecognized cycle type: %s\n", cycleType.c_str());
+  // Getting test script file path
+  options.scriptFilePath = program.get<std::string>("scriptFile");
+  const auto &scriptFilePath = options.scriptFilePath;
 
-  // Getting warmup setting
-  const auto useWarmUp = program.get<bool>("--warmup");
+  // Getting sequence file path
+  options.sequenceFilePath = program.get<std::string>("sequenceFile");
 
-  // Loading script file
-  std::string configJsRaw;
-  if (jaffarCommon::file::loadStringFromFile(configJsRaw, scriptFilePath) == false) JAFFAR_THROW_LOGIC("Could not find/read script file: %s\n", scriptFilePath.c_str());
+  // Getting path where to save the hash output (if any)
+  options.hashOutputFile = program.get<std::string>("--hashOutputFile");
 
-  // Parsing script
-  const auto configJs = nlohmann::json::parse(configJsRaw);
+  // Getting path where to save the test results (if any)
+  options.resultOutputFile = program.get<std::string>("--resultOutputFile");
 
-  // Getting rom file path
-  const auto romFilePath = jaffarCommon::json::getString(configJs, "Rom File Path");
+  // Getting path where to save the per-input phase timings (if any)
+  options.phaseTimingOutputFile = program.get<std::string>("--phaseTimingOutputFile");
 
-  // Getting initial state file path
-  const auto initialStateFilePath = jaffarCommon::json::getString(configJs, "Initial State File");
+  // Getting cycle type
+  options.cycleType = program.get<std::string>("--cycleType");
+  if (jaffar::testRunner::isCycleTypeRecognized(options.cycleType) == false) JAFFAR_THROW_LOGIC("Unrecognized cycle type: %s\n", options.cycleType.c_str());
 
-  // Getting sequence file path
-  std::string sequenceFilePath = program.get<std::string>("sequenceFile");
+  // Getting branching settings
+  const auto branchFactorString = program.get<std::string>("--branchFactor");
+  options.branchInputFilePath = program.get<std::string>("--branchInputFile");
+  if (options.cycleType == "Branch")
+  {
+    if (jaffar::argumentParser::parseUnsigned(branchFactorString, options.branchFactor) == false) JAFFAR_THROW_LOGIC("Invalid branch factor: %s\n", branchFactorString.c_str());
+    if (options.branchFactor == 0) JAFFAR_THROW_LOGIC("The branch factor must be at least 1\n");
+  }
 
-  // Getting expected Rom SHA1 hash
-  const auto expectedRomSHA1 = jaffarCommon::json::getString(configJs, "Expected Rom SHA1");
+  // Getting warmup setting
+  options.useWarmUp = program.get<bool>("--warmup");
 
-  // Parsing disabled blocks in lite state serialization
-  const auto stateDisabledBlocks = jaffarCommon::json::getArray<std::string>(configJs, "Disable State Blocks");
-  std::string stateDisabledBlocksOutput;
-  for (const auto& entry : stateDisabledBlocks) stateDisabledBlocksOutput += entry + std::string(" ");
-  
-  // Getting Controller types
-  const auto controller1Type = jaffarCommon::json::getString(configJs, "Controller 1 Type");
-  const auto controller2Type = jaffarCommon::json::getString(configJs, "Controller 1 Type");
+  // Getting incremental hash setting
+  options.useIncrementalHash = program.get<bool>("--incrementalHash");
 
-  // Loading Rom File
-  std::string romFileData;
-  if (jaffarCommon::file::loadStringFromFile(romFileData, romFilePath) == false) JAFFAR_THROW_LOGIC("Could not rom file: %s\n", romFilePath.c_str());
+  // Getting incremental restore setting
+  options.useIncrementalRestore = program.get<bool>("--incrementalRestore");
 
-  // Calculating Rom SHA1
-  auto romSHA1 = jaffarCommon::hash::getSHA1String(romFileData);
+  // Getting telemetry settings
+  options.telemetryOutputFile = program.get<std::string>("--telemetryOutputFile");
+  options.useTelemetryChecksums = program.get<bool>("--telemetryChecksums");
+  if (options.telemetryOutputFile != "" && jaffar::telemetry::isEnabled() == false) JAFFAR_THROW_LOGIC("Telemetry output was requested, but telemetry support was not built in (meson option 'enableTelemetry')\n");
 
-  // Checking with the expected SHA1 hash
-  if (romSHA1 != expectedRomSHA1) JAFFAR_THROW_LOGIC("Wrong Rom SHA1. Found: '%s', Expected: '%s'\n", romSHA1.c_str(), expectedRomSHA1.c_str());
+  // Getting path where to save the per-input video and audio digests (if any)
+  options.avHashOutputFile = program.get<std::string>("--avHashOutputFile");
 
-  // Creating emulator instance
-  auto e = jaffar::EmuInstance(configJs);
+  // Getting comparison settings. Only the results are saved, as the other outputs would be overwritten by each run
+  const auto useCpuCoreComparison = program.get<bool>("--compareCpuCores");
+  if (useCpuCoreComparison == true && (options.hashOutputFile != "" || options.phaseTimingOutputFile != "" || options.telemetryOutputFile != "" || options.avHashOutputFile != "")) JAFFAR_THROW_LOGIC("Only the result output file can be saved when comparing runs\n");
 
-  // Initializing emulator instance
-  if (e.initialize() == false) JAFFAR_THROW_LOGIC("Error initializing emulator\n");
-  
-  // If an initial state is provided, load it now
-  if (initialStateFilePath != "")
-  {
-    std::string stateFileData;
-    if (jaffarCommon::file::loadStringFromFile(stateFileData, initialStateFilePath) == false) JAFFAR_THROW_LOGIC("Could not initial state file: %s\n", initialStateFilePath.c_str());
-    jaffarCommon::deserializer::Contiguous d(stateFileData.data());
-    e.deserializeState(d);
-  }
-  
-  // Disabling requested blocks from state serialization
-  for (const auto& block : stateDisabledBlocks) e.disableStateBlock(block);
-
-  // Disable rendering
-  e.disableRendering();
-
-  // Getting full state size
-  const auto stateSize = e.getStateSize();
-
-  // Loading sequence file
-  std::string sequenceRaw;
-  if (jaffarCommon::file::loadStringFromFile(sequenceRaw, sequenceFilePath) == false) JAFFAR_THROW_LOGIC("[ERROR] Could not find or read from input sequence file: %s\n", sequenceFilePath.c_str());
-
-  // Building sequence information
-  const auto sequence = jaffarCommon::string::split(sequenceRaw, '\n');
-
-  // Getting sequence lenght
-  const auto sequenceLength = sequence.size();
-
-  // Getting input parser from the emulator
-  const auto inputParser = e.getInputParser();
-
-  // Getting decoded emulator input for each entry in the sequence
-  std::vector<jaffar::input_t> decodedSequence;
-  for (const auto &inputString : sequence) decodedSequence.push_back(inputParser->parseInputString(inputString));
-
-  // Getting emulation core name
-  std::string emulationCoreName = e.getCoreName();
-
-  // Printing test information
-  printf("[] -----------------------------------------\n");
-  printf("[] Running Script:                         '%s'\n", scriptFilePath.c_str());
-  printf("[] Cycle Type:                             '%s'\n", cycleType.c_str());
-  printf("[] Emulation Core:                         '%s'\n", emulationCoreName.c_str());
-  printf("[] Rom File:                               '%s'\n", romFilePath.c_str());
-  printf("[] Controller Types:                       '%s' : '%s'\n", controller1Type.c_str(), controller2Type.c_str());
-  printf("[] Rom Hash:                               'SHA1: %s'\n", romSHA1.c_str());
-  printf("[] Sequence File:                          '%s'\n", sequenceFilePath.c_str());
-  printf("[] Sequence Length:                        %lu\n", sequenceLength);
-  printf("[] State Size:                             %lu bytes - Disabled Blocks:  [ %s ]\n", stateSize, stateDisabledBlocksOutput.c_str());
-  
-  // If warmup is enabled, run it now. This helps in reducing variation in performance results due to CPU throttling
-  if (useWarmUp)
-  {
-    printf("[] ********** Warming Up **********\n");
+  // Getting rom image hash cache directory
+  const auto romHashCacheDirectory = program.get<std::string>("--romHashCacheDirectory");
 
-    auto tw = jaffarCommon::timing::now();
-    double waitedTime = 0.0;
-    #pragma omp parallel
-    while(waitedTime < 2.0) waitedTime = jaffarCommon::timing::timeDeltaSeconds(jaffarCommon::timing::now(), tw);
-  }
+  // Getting core log level
+  const auto logLevelString = program.get<std::string>("--logLevel");
+  retro_log_level logLevel = RETRO_LOG_WARN;
+  bool logLevelRecognized = false;
+  if (logLevelString == "Debug") { logLevel = RETRO_LOG_DEBUG; logLevelRecognized = true; }
+  if (logLevelString == "Info") { logLevel = RETRO_LOG_INFO; logLevelRecognized = true; }
+  if (logLevelString == "Warn") { logLevel = RETRO_LOG_WARN; logLevelRecognized = true; }
+  if (logLevelString == "Error") { logLevel = RETRO_LOG_ERROR; logLevelRecognized = true; }
+  if (logLevelRecognized == false) JAFFAR_THROW_LOGIC("Unrecognized log level: %s\n", logLevelString.c_str());
+  jaffar::telemetry::setLogLevel(logLevel);
 
-  printf("[] ********** Running Test **********\n");
+  // Loading script file
+  std::string configJsRaw;
+  if (jaffarCommon::file::loadStringFromFile(configJsRaw, scriptFilePath) == false) JAFFAR_THROW_LOGIC("Could not find/read script file: %s\n", scriptFilePath.c_str());
 
-  fflush(stdout);
+  // Parsing script
+  const auto configJs = nlohmann::json::parse(configJsRaw);
 
-  // Serializing initial state
-  auto currentState = (uint8_t *)malloc(stateSize);
+  // If comparing CPU cores, run the sequence under each of them instead
+  if (useCpuCoreComparison == true)
   {
-    jaffarCommon::serializer::Contiguous cs(currentState);
-    e.serializeState(cs);
+    std::vector<runVariant_t> variants;
+    for (const auto &cpuCore : _cpuCores) variants.push_back({ cpuCore, [cpuCore](jaffar::EmuInstance &e, jaffar::testRunner::options_t &) { e.setCoreOption(_CPU_CORE_OPTION, cpuCore); } });
+    return compareRuns("CPU Core Comparison", "CPU Cores", variants, configJs, options, romHashCacheDirectory);
   }
 
-  // Check whether to perform each action
-  bool doPreAdvance = cycleType == "Rerecord";
-  bool doDeserialize = cycleType == "Rerecord";
-  bool doSerialize = cycleType == "Rerecord";
+  // Creating emulator instance
+  auto e = jaffar::EmuInstance(configJs);
+  e.setRomHashCacheDirectory(romHashCacheDirectory);
 
-  // Actually running the sequence
-  auto t0 = std::chrono::high_resolution_clock::now();
-  int i = 0; 
-  for (const auto &input : decodedSequence)
-  {
-    printf("Running Frame %d\n",i++);
-    if (doPreAdvance == true) e.advanceState(input);
-    
-    if (doDeserialize == true)
-    {
-      jaffarCommon::deserializer::Contiguous d(currentState, stateSize);
-      e.deserializeState(d);
-    } 
-    
-    e.advanceState(input);
+  // Booting the emulator into the script's initial state
+  jaffar::testRunner::initializeEmulator(e, configJs);
 
-    if (doSerialize == true)
-    {
-      auto s = jaffarCommon::serializer::Contiguous(currentState, stateSize);
-      e.serializeState(s);
-    } 
-  }
-  auto tf = std::chrono::high_resolution_clock::now();
-
-  // Calculating running time
-  auto dt = std::chrono::duration_cast<std::chrono::nanoseconds>(tf - t0).count();
-  double elapsedTimeSeconds = (double)dt * 1.0e-9;
-
-  // Calculating final state hash
-  auto result = e.getStateHash();
-
-  // Creating hash string
-  char hashStringBuffer[256];
-  sprintf(hashStringBuffer, "0x%lX%lX", result.first, result.second);
-
-  // Printing time information
-  printf("[] Elapsed time:                           %3.3fs\n", (double)dt * 1.0e-9);
-  printf("[] Performance:                            %.3f inputs / s\n", (double)sequenceLength / elapsedTimeSeconds);
-  printf("[] Final State Hash:                       %s\n", hashStringBuffer);
-  
-  // If saving hash, do it now
-  if (hashOutputFile != "") jaffarCommon::file::saveStringToFile(std::string(hashStringBuffer), hashOutputFile.c_str());
+  // Running test
+  jaffar::testRunner::run(e, configJs, options);
 
   // Finalizing emulator instance
   e.finalize();
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+# Runs a single tester benchmark and compares its throughput against a stored baseline.
+# The tester's JSON results are kept under the output directory, one file per benchmark.
+# The baseline is a JSON object mapping benchmark names to their stored results.
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+
+parser = argparse.ArgumentParser(description='Runs a tester benchmark and checks it for performance regressions')
+parser.add_argument('--tester', required=True, help='Path to the tester executable')
+parser.add_argument('--name', required=True, help='Benchmark name, used as key in the baseline')
+parser.add_argument('--script', required=True, help='Test script file')
+parser.add_argument('--sequence', required=True, help='Input sequence file')
+parser.add_argument('--cycleType', required=True, help='Tester cycle type')
+parser.add_argument('--branchFactor', type=int, default=None, help='Branch factor for the Branch cycle type (tester default if not given)')
+parser.add_argument('--baseline', required=True, help='Baseline results file')
+parser.add_argument('--threshold', type=float, default=10.0, help='Maximum throughput loss against the baseline, in percent')
+parser.add_argument('--outputDir', required=True, help='Directory to store the results in')
+parser.add_argument('--updateBaseline', action='store_true', help='Store the results as the new baseline instead of comparing')
+args = parser.parse_args()
+
+os.makedirs(args.outputDir, exist_ok=True)
+resultFile = os.path.join(args.outputDir, args.name + '.json')
+
+# Running tester
+command = [ args.tester, args.script, args.sequence, '--cycleType', args.cycleType, '--warmup', '--resultOutputFile', resultFile ]
+if args.branchFactor is not None: command += [ '--branchFactor', str(args.branchFactor) ]
+status = subprocess.run(command)
+if status.returncode != 0:
+  print('[] Tester failed with exit code %d' % status.returncode)
+  sys.exit(status.returncode)
+
+with open(resultFile) as f: result = json.load(f)
+throughput = result['Inputs Per Second']
+print('[] Benchmark:                              %s' % args.name)
+print('[] Performance:                            %.3f inputs / s' % throughput)
+
+# Loading baseline, if any
+baseline = {}
+if os.path.exists(args.baseline):
+  with open(args.baseline) as f: baseline = json.load(f)
+
+# Storing new baseline entry, replacing the file atomically
+if args.updateBaseline:
+  baseline[args.name] = { 'Inputs Per Second': throughput, 'Final State Hash': result['Final State Hash'] }
+  baselineDir = os.path.dirname(os.path.abspath(args.baseline))
+  with tempfile.NamedTemporaryFile('w', dir=baselineDir, delete=False) as f:
+    json.dump(baseline, f, indent=2, sort_keys=True)
+    temporaryFile = f.name
+  os.replace(temporaryFile, args.baseline)
+  print('[] Baseline updated:                       %s' % args.baseline)
+  sys.exit(0)
+
+if args.name not in baseline:
+  print('[] Baseline:                               none found, not comparing')
+  sys.exit(0)
+
+reference = baseline[args.name]
+change = 100.0 * (throughput - reference['Inputs Per Second']) / reference['Inputs Per Second']
+result['Baseline Inputs Per Second'] = reference['Inputs Per Second']
+result['Change Percent'] = change
+with open(resultFile, 'w') as f: json.dump(result, f, indent=2)
+
+print('[] Baseline Performance:                   %.3f inputs / s' % reference['Inputs Per Second'])
+print('[] Change:                                 %+.2f%% (threshold: -%.2f%%)' % (change, args.threshold))
+
+# A different final state is not a performance issue, but it is worth knowing about
+if reference.get('Final State Hash') != result['Final State Hash']:
+  print('[] Warning: final state hash %s differs from the baseline (%s)' % (result['Final State Hash'], reference.get('Final State Hash')))
+
+if change < -args.threshold:
+  print('[] Performance regression detected')
+  sys.exit(1)
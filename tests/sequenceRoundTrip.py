@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+
+# Checks the sequence converter over the full range of analog values. Every value must be accepted, and come back from
+# a text -> binary -> text round trip as its canonical form: a value producing the same 8-bit stick position in the core,
+# so that replays stay identical. Canonical values must come back unchanged.
+
+import argparse
+import math
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+parser = argparse.ArgumentParser(description='Runs text -> binary -> text round trips through the sequence converter')
+parser.add_argument('--converter', required=True, help='Path to the sequenceConverter executable')
+args = parser.parse_args()
+
+def inputLine(buttons, analogs):
+  return '|..|%s|%s|\n' % (buttons, ','.join('%6d' % value for value in analogs))
+
+def parseAnalogs(line):
+  return [ int(value) for value in line.strip().strip('|').split('|')[2].split(',') ]
+
+def roundTrip(directory, lines):
+  textFile = os.path.join(directory, 'input.sol')
+  binaryFile = os.path.join(directory, 'input.bin')
+  roundTripFile = os.path.join(directory, 'output.sol')
+  with open(textFile, 'w') as f: f.writelines(lines)
+  for source, target, format in [ (textFile, binaryFile, 'Binary'), (binaryFile, roundTripFile, 'Text') ]:
+    result = subprocess.run([ args.converter, source, target, '--format', format ], capture_output=True, text=True)
+    if result.returncode != 0:
+      print('[] Conversion to %s failed:\n%s%s' % (format, result.stdout, result.stderr))
+      sys.exit(1)
+  with open(roundTripFile) as f: return f.readlines()
+
+# Stick position the core derives from an analog value, in single precision like the core (libretro.cpp, __CtrlSetAnalogXY)
+def float32(value): return struct.unpack('f', struct.pack('f', value))[0]
+def stickPosition(value):
+  scaled = float32(float32(float32(value / 32767.0) * 127.5) + 127.5)
+  return min(max(math.ceil(scaled), 0), 255)
+
+allValues = list(range(-32768, 32768))
+buttons = [ 'U.L.Ss.T..l.', '.D.R..QTCXlr', '............' ]
+
+failures = 0
+with tempfile.TemporaryDirectory() as directory:
+
+  # Every int16 value, spread over all four axes
+  lines = [ inputLine(buttons[i % len(buttons)], allValues[i * 4:i * 4 + 4]) for i in range(len(allValues) // 4) ]
+  roundTripLines = roundTrip(directory, lines)
+  if len(roundTripLines) != len(lines):
+    print('[] Line count mismatch: %d vs %d' % (len(lines), len(roundTripLines)))
+    sys.exit(1)
+
+  canonicalOf = {}
+  for original, converted in zip(lines, roundTripLines):
+    if original.split('|')[2] != converted.split('|')[2]: print('[] Buttons mismatch: %s vs %s' % (original.rstrip(), converted.rstrip())); failures += 1
+    for value, canonical in zip(parseAnalogs(original), parseAnalogs(converted)):
+      canonicalOf[value] = canonical
+      if stickPosition(value) != stickPosition(canonical): print('[] Analog value %d came back as %d, which gives another stick position' % (value, canonical)); failures += 1
+
+  # One canonical value per stick position, and these come back unchanged
+  canonicalValues = set(canonicalOf.values())
+  if len(canonicalValues) != 256: print('[] Expected 256 canonical analog values, got %d' % len(canonicalValues)); failures += 1
+  for value, canonical in [ (0, 0), (1, 0), (-1, 0), (256, 256), (-32768, -32768), (32767, 32512) ]:
+    if canonicalOf[value] != canonical: print('[] Analog value %d came back as %d instead of %d' % (value, canonicalOf[value], canonical)); failures += 1
+  canonicalValues = sorted(canonicalValues)
+  lines = [ inputLine(buttons[0], [ v, canonicalValues[-1 - i], v, 0 ]) for i, v in enumerate(canonicalValues) ]
+  if roundTrip(directory, lines) != lines: print('[] Canonical analog values did not come back unchanged'); failures += 1
+
+print('[] Round trip %s' % ('failed' if failures > 0 else 'passed'))
+sys.exit(1 if failures > 0 else 0)